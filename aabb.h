@@ -56,36 +56,9 @@ public:
 
     bool hit(const ray &r, interval ray_t) const
     {
-        const point3 &ray_orig = r.origin;
-        const vec3 &ray_dir = r.direction;
-
-        for (int axis = 0; axis < 3; axis++)
-        {
-            const interval &ax = axis_interval(axis);
-            const double adinv = 1.0 / ray_dir[axis];
-
-            auto t0 = (ax.min - ray_orig[axis]) * adinv;
-            auto t1 = (ax.max - ray_orig[axis]) * adinv;
-
-            if (t0 < t1)
-            {
-                if (t0 > ray_t.min)
-                    ray_t.min = t0;
-                if (t1 < ray_t.max)
-                    ray_t.max = t1;
-            }
-            else
-            {
-                if (t1 > ray_t.min)
-                    ray_t.min = t1;
-                if (t0 < ray_t.max)
-                    ray_t.max = t0;
-            }
-
-            if (ray_t.max <= ray_t.min)
-                return false;
-        }
-        return true;
+        return slab(x, r.origin.x, r.direction.x, ray_t) &&
+               slab(y, r.origin.y, r.direction.y, ray_t) &&
+               slab(z, r.origin.z, r.direction.z, ray_t);
     }
 
     int longest_axis() const
@@ -98,12 +71,53 @@ public:
             return y.size() > z.size() ? 1 : 2;
     }
 
+    real surface_area() const
+    {
+        // Returns the surface area of the box, used by the BVH cost model.
+        real dx = x.size(), dy = y.size(), dz = z.size();
+        return 2.0 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    real max_abs_coordinate() const
+    {
+        // Returns the largest magnitude of any coordinate in the box.
+        return std::fmax(std::fmax(std::fmax(std::fabs(x.min), std::fabs(x.max)),
+                                   std::fmax(std::fabs(y.min), std::fabs(y.max))),
+                         std::fmax(std::fabs(z.min), std::fabs(z.max)));
+    }
+
     static const aabb empty, universe;
 
 private:
+    static bool slab(const interval &ax, real origin, real direction, interval &ray_t)
+    {
+        // Clips ray_t against one slab; returns false once the interval becomes empty.
+        const real adinv = 1.0 / direction;
+
+        auto t0 = (ax.min - origin) * adinv;
+        auto t1 = (ax.max - origin) * adinv;
+
+        if (t0 < t1)
+        {
+            if (t0 > ray_t.min)
+                ray_t.min = t0;
+            if (t1 < ray_t.max)
+                ray_t.max = t1;
+        }
+        else
+        {
+            if (t1 > ray_t.min)
+                ray_t.min = t1;
+            if (t0 < ray_t.max)
+                ray_t.max = t0;
+        }
+
+        return ray_t.max > ray_t.min;
+    }
+
     void pad_to_minimums()
     {
-        double delta = 0.0001;
+        real delta = 0.0001;
         if (x.size() < delta)
             x = x.expand(delta);
         if (y.size() < delta)
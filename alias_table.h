@@ -0,0 +1,86 @@
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+#include "raytracer.h"
+
+#include <cstdint>
+#include <vector>
+
+// Discrete distribution over indices 0..n-1 in proportion to non-negative weights, sampled in
+// constant time (Walker's alias method, with Vose's construction).
+class alias_table
+{
+public:
+    alias_table() {}
+
+    explicit alias_table(const std::vector<real> &weights)
+    {
+        double total = 0;
+        for (real w : weights)
+            total += w;
+        if (!(total > 0))
+            return;
+
+        const size_t n = weights.size();
+        bins.resize(n);
+        for (size_t i = 0; i < n; i++)
+            bins[i].pmf = real(weights[i] / total);
+
+        // Split the scaled probabilities into under- and over-full bins, then top up each
+        // under-full bin with probability taken from an over-full one.
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> under, over;
+        for (size_t i = 0; i < n; i++)
+        {
+            scaled[i] = double(weights[i]) / total * double(n);
+            (scaled[i] < 1 ? under : over).push_back(uint32_t(i));
+        }
+
+        while (!under.empty() && !over.empty())
+        {
+            uint32_t small = under.back(), large = over.back();
+            under.pop_back();
+            over.pop_back();
+
+            bins[small].threshold = real(scaled[small]);
+            bins[small].alias = large;
+
+            scaled[large] -= 1 - scaled[small];
+            (scaled[large] < 1 ? under : over).push_back(large);
+        }
+
+        // Whatever is left is full up to rounding error.
+        for (uint32_t i : under)
+            bins[i].threshold = 1;
+        for (uint32_t i : over)
+            bins[i].threshold = 1;
+    }
+
+    bool empty() const { return bins.empty(); }
+    size_t size() const { return bins.size(); }
+
+    // Index for a uniform u in [0,1), and the probability it had of being picked.
+    size_t sample(real u, real &pmf) const
+    {
+        size_t index = std::min(size_t(u * real(bins.size())), bins.size() - 1);
+        real remainder = u * real(bins.size()) - real(index);
+        if (remainder >= bins[index].threshold)
+            index = bins[index].alias;
+        pmf = bins[index].pmf;
+        return index;
+    }
+
+    real pmf(size_t index) const { return bins[index].pmf; }
+
+private:
+    struct bin
+    {
+        real threshold = 1; // Keep this bin's index when the remainder of u is below threshold
+        real pmf = 0;
+        uint32_t alias = 0;
+    };
+
+    std::vector<bin> bins;
+};
+
+#endif
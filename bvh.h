@@ -4,95 +4,240 @@
 #include "aabb.h"
 #include "hittable.h"
 #include "hittable_list.h"
-#include <algorithm>
-
-class bvh_node : public hittable
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Acceleration structure over abstract primitives. The SAH builder produces a binary hierarchy,
+// which is either traversed directly (width 2) or collapsed into 4 or 8 wide SIMD nodes.
+class bvh_accel
 {
 public:
-    bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size())
+    void build(const std::vector<aabb> &prim_bounds, const bvh_build_options &options,
+               std::vector<uint32_t> &order)
     {
-        // There's a C++ subtlety here. This constructor (without span indices) creates an
-        // implicit copy of the hittable list, which we will modify. The lifetime of the copied
-        // list only extends until this constructor exits. That's OK, because we only need to
-        // persist the resulting bounding volume hierarchy.
+        auto start_time = std::chrono::steady_clock::now();
+
+        binary.build(prim_bounds, options, order);
+        cost = binary.sah_cost();
+        method = options.method;
+
+        width = options.width >= 8 ? 8 : options.width >= 4 ? 4 : 2;
+        if (width == 4)
+            wide4.build(binary);
+        else if (width == 8)
+            wide8.build(binary);
+
+        if (width != 2)
+            binary = linear_bvh(); // The wide nodes replace the binary ones
+
+        build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
     }
 
-    bvh_node(std::vector<shared_ptr<hittable>> &objects, size_t start, size_t end)
-    {
-        // Build the bounding box of the span of source objects.
-        bbox = aabb::empty;
-        for (size_t object_index = start; object_index < end; object_index++)
-            bbox = aabb(bbox, objects[object_index]->bounding_box());
+    // Expected SAH cost of the binary hierarchy the structure was built from.
+    double sah_cost() const { return cost; }
 
-        int axis = bbox.longest_axis();
+    int node_width() const { return width; }
 
-        auto comparator = (axis == 0)   ? box_x_compare
-                          : (axis == 1) ? box_y_compare
-                                        : box_z_compare;
+    size_t memory_bytes() const
+    {
+        return binary.nodes.capacity() * sizeof(linear_bvh_node) +
+               wide4.nodes.capacity() * sizeof(wide_bvh_node<4>) +
+               wide8.nodes.capacity() * sizeof(wide_bvh_node<8>);
+    }
 
-        size_t object_span = end - start;
+    // Wall-clock time of the last build, including collapsing to wide nodes, in seconds.
+    double build_time() const { return build_seconds; }
 
-        if (object_span == 1)
-        {
-            left = right = objects[start];
-        }
-        else if (object_span == 2)
-        {
-            left = objects[start];
-            right = objects[start + 1];
-        }
+    // One-line summary of the last build, e.g. "sah 4-wide, 12.3 ms, SAH cost 20.1".
+    std::string build_report() const
+    {
+        std::ostringstream report;
+        report << (method == bvh_build_method::lbvh ? "lbvh " : "sah ") << width << "-wide, "
+               << build_seconds * 1000.0 << " ms, SAH cost " << cost;
+        return report.str();
+    }
+
+    // Calls visit(first, count) once for every leaf, in no particular order.
+    template <typename Fn>
+    void for_each_leaf(Fn &&visit) const
+    {
+        if (width == 8)
+            wide8.for_each_leaf(visit);
+        else if (width == 4)
+            wide4.for_each_leaf(visit);
         else
-        {
-            std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
+            binary.for_each_leaf(visit);
+    }
 
-            auto mid = start + object_span / 2;
-            left = make_shared<bvh_node>(objects, start, mid);
-            right = make_shared<bvh_node>(objects, mid, end);
-        }
+    // Same contract as linear_bvh::traverse.
+    template <typename LeafFn>
+    bool traverse(const ray &r, interval ray_t, LeafFn &&intersect_leaf) const
+    {
+        if (width == 8)
+            return wide8.traverse(r, ray_t, intersect_leaf);
+        if (width == 4)
+            return wide4.traverse(r, ray_t, intersect_leaf);
+        return binary.traverse(r, ray_t, intersect_leaf);
+    }
 
-        // bbox = aabb(left->bounding_box(), right->bounding_box());
+    // Same contract as linear_bvh::traverse_packet.
+    template <typename LaneLeafFn>
+    unsigned traverse_packet(ray_packet &packet, unsigned active, LaneLeafFn &&intersect_leaf) const
+    {
+        if (width == 8)
+            return wide8.traverse_packet(packet, active, intersect_leaf);
+        if (width == 4)
+            return wide4.traverse_packet(packet, active, intersect_leaf);
+        return binary.traverse_packet(packet, active, intersect_leaf);
     }
 
-    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+private:
+    linear_bvh binary;
+    wide_bvh<4> wide4;
+    wide_bvh<8> wide8;
+    int width = 2;
+    double cost = 0;
+    double build_seconds = 0;
+    bvh_build_method method = bvh_build_method::sah;
+};
+
+class bvh_node : public hittable
+{
+public:
+    bvh_node(const hittable_list &list, const bvh_build_options &options = bvh_build_options())
+        : bvh_node(list.objects, options)
     {
-        if (!bbox.hit(r, ray_t))
-            return false;
+    }
 
-        bool hit_left = left->hit(r, ray_t, rec);
-        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+    bvh_node(const std::vector<shared_ptr<hittable>> &objects,
+             const bvh_build_options &options = bvh_build_options())
+    {
+        std::vector<aabb> boxes;
+        boxes.reserve(objects.size());
+        bbox = aabb::empty;
+        for (const auto &object : objects)
+        {
+            boxes.push_back(object->bounding_box());
+            bbox = aabb(bbox, boxes.back());
+        }
 
-        return hit_left || hit_right;
+        // Store the primitives in leaf order so every leaf covers a contiguous run of them.
+        std::vector<uint32_t> order;
+        tree.build(boxes, options, order);
+        primitives.reserve(order.size());
+        for (uint32_t index : order)
+            primitives.push_back(objects[index]);
     }
 
-    aabb bounding_box() const override { return bbox; }
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        auto intersect_leaf = [&](uint32_t first, uint32_t count, interval &t)
+        {
+            bool hit_anything = false;
+            for (uint32_t i = first; i < first + count; i++)
+            {
+                if (primitives[i]->hit(r, t, rec))
+                {
+                    hit_anything = true;
+                    t.max = rec.t;
+                }
+            }
+            return hit_anything;
+        };
+
+        return tree.traverse(r, ray_t, intersect_leaf);
+    }
 
-private:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
-    aabb bbox;
+    unsigned hit_packet(ray_packet &packet, unsigned active, hit_record *recs) const override
+    {
+        if (!packet.coherent(active))
+            return hittable::hit_packet(packet, active, recs);
 
-    static bool box_compare(
-        const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index)
+        auto intersect_leaf = [&](int lane, uint32_t first, uint32_t count, interval &t)
+        {
+            bool hit_anything = false;
+            for (uint32_t i = first; i < first + count; i++)
+            {
+                if (hit_packet_lane(*primitives[i], packet, lane, t, recs[lane]))
+                {
+                    hit_anything = true;
+                    t.max = recs[lane].t;
+                }
+            }
+            return hit_anything;
+        };
+
+        return tree.traverse_packet(packet, active, intersect_leaf);
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
     {
-        auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
-        auto b_axis_interval = b->bounding_box().axis_interval(axis_index);
-        return a_axis_interval.min < b_axis_interval.min;
+        auto occluded_leaf = [&](uint32_t first, uint32_t count, interval &t)
+        {
+            for (uint32_t i = first; i < first + count; i++)
+            {
+                if (primitives[i]->occluded(r, t))
+                {
+                    t = interval::empty; // Any hit will do
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        return tree.traverse(r, ray_t, occluded_leaf);
     }
 
-    static bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+    unsigned occluded_packet(ray_packet &packet, unsigned active) const override
     {
-        return box_compare(a, b, 0);
+        if (!packet.coherent(active))
+            return hittable::occluded_packet(packet, active);
+
+        auto occluded_leaf = [&](int lane, uint32_t first, uint32_t count, interval &t)
+        {
+            for (uint32_t i = first; i < first + count; i++)
+            {
+                if (occluded_packet_lane(*primitives[i], packet, lane, t))
+                {
+                    t = interval::empty;
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        return tree.traverse_packet(packet, active, occluded_leaf);
     }
 
-    static bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+    aabb bounding_box() const override { return bbox; }
+
+    void collect_emitters(std::vector<const hittable *> &emitters) const override
     {
-        return box_compare(a, b, 1);
+        for (const auto &primitive : primitives)
+            primitive->collect_emitters(emitters);
     }
 
-    static bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+    void register_materials(material_table &table) override
     {
-        return box_compare(a, b, 2);
+        for (const auto &primitive : primitives)
+            primitive->register_materials(table);
     }
+
+    // Expected SAH cost of tracing a ray through this hierarchy. Lower is better.
+    double sah_cost() const { return tree.sah_cost(); }
+
+    // Build method, width, time and SAH cost of this hierarchy.
+    std::string build_report() const { return tree.build_report(); }
+
+private:
+    bvh_accel tree;
+    std::vector<shared_ptr<hittable>> primitives;
+    aabb bbox;
 };
 
-#endif
\ No newline at end of file
+#endif
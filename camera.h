@@ -4,17 +4,33 @@
 #include "raytracer.h"
 #include "hittable.h"
 #include "material.h"
+#include "scene.h"
 #include "cubemap.h"
+#include "emitters.h"
+#include "sampler.h"
+#include "scheduler.h"
+#include "wavefront.h"
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <mutex>
 #include <string>
 #include <variant>
+#include <vector>
 
 class camera
 {
 public:
-    double aspect_ratio = 1.0; // Width over Height Ratio
+    real aspect_ratio = 1.0; // Width over Height Ratio
     int image_width = 100;     // Pixel count of image width
     int samples_per_pixel = 10;
-    int max_depth = 10;
+    int max_depth = 10; // Ray segments per path
+
+    // Bounces of each kind a path may take (see scatter_lobe); negative leaves only max_depth.
+    int max_diffuse_depth = -1;
+    int max_specular_depth = -1;     // Mirror and metal reflection
+    int max_transmission_depth = -1; // Refraction
+    int russian_roulette_depth = 3;  // Segments traced before Russian roulette may end a path
     std::variant<color, std::string> background = color(0.70, 0.80, 1.00);
     shared_ptr<cubemap> skybox;
 
@@ -22,37 +38,121 @@ public:
     vec3 angles = vec3(0, 0, 0);
 
     // Position and Orientation
-    double vfov = 90;
+    real vfov = 90;
     vec3 camera_center = point3(0, 0, 0); // also lookfrom
     point3 lookat = point3(0, 0, -1);
     vec3 vup = vec3(0, 1, 0); // relative up direction of camera
 
-    double defocus_angle = 0; // Variation angle of rays through each pixel
-    double focus_dist = 10;   // Distance from camera lookfrom point to plane of perfect focus
-
-    void render(const hittable &world)
+    real defocus_angle = 0; // Variation angle of rays through each pixel
+    real focus_dist = 10;   // Distance from camera lookfrom point to plane of perfect focus
+
+    int thread_count = 0;  // Render threads (0 = use all hardware threads)
+    int tile_size = 16;    // Edge length of a square render tile in pixels
+    unsigned int seed = 0; // Selects the noise pattern; the same seed reproduces the same image
+    sampler_type sample_pattern = sampler_type::sobol; // Where pixel samples draw their values from
+    bool sample_lights = true; // Next-event estimation: sample an emitter at each diffuse bounce
+
+    // Wavefront mode: each tile's samples are traced as batches of up to wavefront_batch_size
+    // paths, one stage at a time (intersect, sort by material, shade, compact) instead of one
+    // path at a time. The image is identical either way.
+    bool wavefront = false;
+    int wavefront_batch_size = 4096;
+
+    // Trace the camera rays of up to eight samples of a pixel together, as a ray packet sharing
+    // each BVH node test (ray_packet.h). Incoherent packets fall back to one ray at a time.
+    bool packet_camera_rays = true;
+
+    // Filter image textures over each path's ray cone: a cone as wide as a pixel at the camera
+    // that keeps widening at the same rate along the path. Wider footprints read coarser mip
+    // levels. If false, textures are sampled bilinearly at full resolution.
+    bool texture_lod = true;
+
+    // How light samples and scattered rays that reach the same emitter are weighted against each
+    // other (multiple importance sampling).
+    enum class mis_heuristic
+    {
+        balance,
+        power
+    };
+    mis_heuristic mis = mis_heuristic::power;
+
+    // Adaptive sampling: each pixel takes at least adaptive_min_spp samples and at most
+    // samples_per_pixel, stopping once the 95% confidence intervals of its luminance and its
+    // neighbours' (tile borders included) are within adaptive_error of the mean (relative; very
+    // dark pixels use an absolute floor instead).
+    bool adaptive_sampling = false;
+    int adaptive_min_spp = 16;
+    real adaptive_error = 0.02;
+    std::string sample_count_file; // If set, adaptive renders write samples per pixel here (PPM)
+
+    void render(scene &world)
     {
         init();
+        world.register_materials();
+        materials = &world.materials;
+        emitters.collect(world);
+
+        // Light samples go to the sky or the emitters, half and half when there are both.
+        environment_pmf = 0;
+        if (skybox && skybox->can_sample_directions())
+            environment_pmf = emitters.empty() ? 1.0 : 0.5;
+        if (sample_lights && !emitters.empty())
+            std::clog << "Sampling " << emitters.size() << " emitters directly\n";
+        if (sample_lights && environment_pmf > 0)
+            std::clog << "Sampling the skybox directly\n";
+        world_bounds = world.bounding_box();
+
+        // Split the image into tiles and render them in parallel into an in-memory framebuffer.
+        // Every pixel is written exactly once, by whichever thread owns its tile.
+        std::vector<color> framebuffer(size_t(image_width) * image_height);
+        std::vector<int> sample_counts(framebuffer.size());
+
+        const int tiles_x = (image_width + tile_size - 1) / tile_size;
+        const int tiles_y = (image_height + tile_size - 1) / tile_size;
+        const int tile_count = tiles_x * tiles_y;
+
+        work_stealing_scheduler scheduler(tile_count,
+                                          work_stealing_scheduler::resolve_thread_count(thread_count));
+
+        std::mutex progress_lock;
+        int tiles_remaining = tile_count;
+
+        auto render_tile = [&](int worker, int tile)
+        {
+            (void)worker;
+            int x0 = (tile % tiles_x) * tile_size;
+            int y0 = (tile / tiles_x) * tile_size;
+            int x1 = std::min(x0 + tile_size, image_width);
+            int y1 = std::min(y0 + tile_size, image_height);
+
+            if (wavefront)
+                render_tile_wavefront(x0, y0, x1, y1, world, framebuffer);
+            else
+                for (int i = y0; i < y1; i++)
+                    for (int j = x0; j < x1; j++)
+                        framebuffer[size_t(i) * image_width + j] = render_pixel(j, i, world);
+
+            std::lock_guard<std::mutex> guard(progress_lock);
+            tiles_remaining--;
+            std::clog << "\rTiles Remaining: " << tiles_remaining << "   " << std::flush;
+        };
+
+        if (adaptive_sampling)
+            render_adaptive(world, framebuffer, sample_counts);
+        else
+            scheduler.run(render_tile);
 
         // FILE OUTPUT
         std::cout << "P3" << std::endl;
         std::cout << image_width << " " << image_height << std::endl;
         std::cout << 255 << std::endl;
-        for (int i = 0; i < image_height; i++)
-        {
-            std::clog << "\rRows Remaining: " << (image_height - i - 1) << "   " << std::flush;
-            for (int j = 0; j < image_width; j++)
-            {
-                color pixel_color(0, 0, 0);
-                for (int sample = 0; sample < samples_per_pixel; sample++) // Anti-aliasing
-                {
-                    ray r = get_ray(j, i);
-                    pixel_color += ray_color(r, max_depth, world);
-                }
-                write_color(std::cout, pixel_samples_scale * pixel_color);
-            }
-        }
-        std::clog << "\rDONE! \n";
+        for (const auto &pixel_color : framebuffer)
+            write_color(std::cout, pixel_color);
+
+        std::clog << "\rDONE!                    \n";
+
+        if (adaptive_sampling)
+            report_sample_counts(sample_counts);
     }
 
     void set_angles_deg(const vec3 &ang_deg)
@@ -65,9 +165,9 @@ public:
     {
         camera_center = euler_to_rt(loc_bl);
 
-        double rx = degrees_to_radians(euler_deg_bl.x);
-        double ry = degrees_to_radians(euler_deg_bl.y);
-        double rz = degrees_to_radians(euler_deg_bl.z);
+        real rx = degrees_to_radians(euler_deg_bl.x);
+        real ry = degrees_to_radians(euler_deg_bl.y);
+        real rz = degrees_to_radians(euler_deg_bl.z);
 
         vec3 f_bl(0, 0, -1); // Camera forward
         vec3 u_bl(0, 1, 0);  // Camera up
@@ -91,7 +191,13 @@ private:
     vec3 defocus_disk_u; // Defocus disk horizontal radius
     vec3 defocus_disk_v; // Defocus disk vertical radius
 
-    double pixel_samples_scale;
+    real pixel_samples_scale;
+    emitter_list emitters; // Lights sampled by next-event estimation
+    const material_table *materials = nullptr; // The rendered scene's; hit_record::mat indexes it
+    shared_ptr<sampler> pixel_sampler;
+    real environment_pmf;  // Probability that a light sample goes to the skybox
+    aabb world_bounds;     // Range of the wavefront ray sort keys
+    real pixel_spread;     // Angle a pixel subtends at the camera, which ray cones widen by
 
     void init()
     {
@@ -102,13 +208,13 @@ private:
         auto theta = degrees_to_radians(vfov);
         auto h = std::tan(theta / 2);
         auto viewport_height = 2 * h * focus_dist;
-        auto viewport_width = viewport_height * (double(image_width) / image_height);
+        auto viewport_width = viewport_height * (real(image_width) / image_height);
 
         if (use_angles)
         {
-            const double pitch = degrees_to_radians(angles.x);
-            const double yaw = degrees_to_radians(angles.y);
-            const double roll = degrees_to_radians(angles.z);
+            const real pitch = degrees_to_radians(angles.x);
+            const real yaw = degrees_to_radians(angles.y);
+            const real roll = degrees_to_radians(angles.z);
 
             // Forward direction from yaw/pitch (FPS-style):
             // yaw around +Y, pitch around +X (right-handed)
@@ -156,8 +262,10 @@ private:
         delta_v = viewport_v / image_height;
 
         first_pixel = camera_center - (focus_dist * w) - viewport_u / 2 - viewport_v / 2;
+        pixel_spread = texture_lod ? delta_u.length() / focus_dist : 0;
 
         pixel_samples_scale = 1.0 / samples_per_pixel;
+        pixel_sampler = make_sampler(sample_pattern, image_width, image_height, samples_per_pixel);
 
         // Calculate the camera defocus disk basis vectors.
         auto defocus_radius = focus_dist * std::tan(degrees_to_radians(defocus_angle / 2));
@@ -178,6 +286,259 @@ private:
         }
     }
 
+    color render_pixel(int i, int j, const hittable &world) const
+    {
+        color pixel_color(0, 0, 0);
+        sample_key keys[ray_packet_size];
+        color colors[ray_packet_size];
+        for (int first = 0; first < samples_per_pixel; first += ray_packet_size) // Anti-aliasing
+        {
+            const int count = std::min(ray_packet_size, samples_per_pixel - first);
+            for (int k = 0; k < count; k++)
+                keys[k] = {uint32_t(i), uint32_t(j), uint32_t(first + k), seed};
+            sample_pixels(keys, count, colors, world);
+            for (int k = 0; k < count; k++)
+                pixel_color += colors[k];
+        }
+        return pixel_samples_scale * pixel_color;
+    }
+
+    // Traces the paths of up to ray_packet_size pixel samples, their camera rays as one packet.
+    void sample_pixels(const sample_key *keys, int count, color *colors, const hittable &world) const
+    {
+        // Each (pixel, sample) pair draws from its own stream, so the image does not depend on
+        // the thread count, the order tiles are traced in, or how many samples other pixels take.
+        path_state paths[ray_packet_size];
+        rng_stream streams[ray_packet_size];
+        ray_packet packet;
+        rng_stream &stream = thread_rng();
+        for (int k = 0; k < count; k++)
+        {
+            stream.start(keys[k], pixel_sampler.get());
+            paths[k].r = packet.rays[k] = get_ray(int(keys[k].x), int(keys[k].y));
+            streams[k] = stream;
+            packet.streams[k] = &streams[k];
+        }
+
+        hit_record recs[ray_packet_size];
+        const unsigned active = max_depth > 0 ? (1u << count) - 1 : 0;
+        const unsigned found = intersect_camera_rays(packet, active, recs, world);
+        for (int k = 0; k < count; k++)
+        {
+            stream = streams[k];
+            if (active && shade_path_hit(paths[k], found & (1u << k), recs[k], world))
+            {
+                while (trace_path_segment(paths[k], world))
+                {
+                }
+            }
+            colors[k] = paths[k].radiance;
+        }
+    }
+
+    // Finds and finalizes the closest hits of the camera rays in the active lanes of packet.
+    // Returns the lanes that hit.
+    unsigned intersect_camera_rays(ray_packet &packet, unsigned active, hit_record *recs, const hittable &world) const
+    {
+        for (unsigned rest = active; rest; rest &= rest - 1)
+            packet.ranges[lowest_bit(rest)] = interval(0, infinity);
+
+        // The base class version traces the rays one at a time.
+        unsigned found = packet_camera_rays ? world.hit_packet(packet, active, recs)
+                                            : world.hittable::hit_packet(packet, active, recs);
+        for (unsigned rest = found; rest; rest &= rest - 1)
+            finalize_hit(packet.rays[lowest_bit(rest)], recs[lowest_bit(rest)]);
+        return found;
+    }
+
+    // Traces one sample per key into colors, a path at a time or as wavefront batches.
+    void trace_samples(const std::vector<sample_key> &keys, std::vector<color> &colors, const hittable &world) const
+    {
+        colors.resize(keys.size());
+        if (wavefront)
+        {
+            for (size_t first = 0; first < keys.size(); first += size_t(wavefront_batch_size))
+                trace_wavefront(keys, first, std::min(keys.size(), first + size_t(wavefront_batch_size)), colors,
+                                world);
+            return;
+        }
+        for (size_t first = 0; first < keys.size(); first += ray_packet_size)
+            sample_pixels(&keys[first], int(std::min(keys.size() - first, size_t(ray_packet_size))), &colors[first],
+                          world);
+    }
+
+    void render_tile_wavefront(int x0, int y0, int x1, int y1, const hittable &world,
+                               std::vector<color> &framebuffer) const
+    {
+        // Whole samples of the tile per batch, as many as fit in wavefront_batch_size paths.
+        const int pixels = (x1 - x0) * (y1 - y0);
+        const int samples_per_batch = std::max(1, wavefront_batch_size / pixels);
+        std::vector<color> sums(size_t(pixels), color(0, 0, 0));
+        std::vector<sample_key> keys;
+        std::vector<color> colors;
+
+        for (int first = 0; first < samples_per_pixel; first += samples_per_batch)
+        {
+            const int last = std::min(samples_per_pixel, first + samples_per_batch);
+            keys.clear();
+            for (int y = y0; y < y1; y++)
+                for (int x = x0; x < x1; x++)
+                    for (int sample = first; sample < last; sample++)
+                        keys.push_back({uint32_t(x), uint32_t(y), uint32_t(sample), seed});
+            trace_samples(keys, colors, world);
+
+            // Keys are pixel-major, so each pixel adds its samples in order, as render_pixel does.
+            for (size_t k = 0; k < keys.size(); k++)
+                sums[size_t(keys[k].y - y0) * (x1 - x0) + (keys[k].x - x0)] += colors[k];
+        }
+
+        for (int y = y0; y < y1; y++)
+            for (int x = x0; x < x1; x++)
+                framebuffer[size_t(y) * image_width + x] = pixel_samples_scale * sums[size_t(y - y0) * (x1 - x0) + (x - x0)];
+    }
+
+    // Running statistics of one pixel in an adaptive render
+    struct pixel_statistics
+    {
+        color sum = color(0, 0, 0);
+        double mean = 0;               // Of the samples' luminance
+        double squared_deviations = 0; // Sum of squared deviations from the mean (Welford)
+        int count = 0;
+        double error = infinity; // Relative half-width of the 95% confidence interval
+        bool done = false;
+    };
+
+    void render_adaptive(const hittable &world, std::vector<color> &framebuffer, std::vector<int> &sample_counts) const
+    {
+        // The image is sampled in passes of batch_size samples per unfinished pixel, each pass
+        // tracing the tiles in parallel. Between passes, a pixel stops once the confidence
+        // intervals of it and its neighbours are all within the target: a rare bright path seen
+        // next door keeps it going, even if its own samples have not caught one yet. Every
+        // decision is taken over the whole image between passes, so the result does not depend
+        // on the tile size or thread count.
+        const int batch_size = 8;
+        std::vector<pixel_statistics> stats(framebuffer.size());
+
+        const int tiles_x = (image_width + tile_size - 1) / tile_size;
+        const int tiles_y = (image_height + tile_size - 1) / tile_size;
+        const int threads = work_stealing_scheduler::resolve_thread_count(thread_count);
+
+        for (int pass = 1, active = image_width * image_height; active > 0; pass++)
+        {
+            work_stealing_scheduler scheduler(tiles_x * tiles_y, threads);
+            scheduler.run([&](int worker, int tile)
+            {
+                (void)worker;
+                int x0 = (tile % tiles_x) * tile_size;
+                int y0 = (tile / tiles_x) * tile_size;
+                sample_tile_adaptive(x0, y0, std::min(x0 + tile_size, image_width),
+                                     std::min(y0 + tile_size, image_height), batch_size, stats, world);
+            });
+
+            active = 0;
+            for (int y = 0; y < image_height; y++)
+            {
+                for (int x = 0; x < image_width; x++)
+                {
+                    pixel_statistics &px = stats[size_t(y) * image_width + x];
+                    if (px.done)
+                        continue;
+
+                    double neighbourhood_error = 0;
+                    for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, image_height - 1); ny++)
+                        for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, image_width - 1); nx++)
+                            neighbourhood_error =
+                                std::max(neighbourhood_error, stats[size_t(ny) * image_width + nx].error);
+
+                    px.done = px.count >= samples_per_pixel ||
+                              (px.count >= adaptive_min_spp && neighbourhood_error <= adaptive_error);
+                    if (!px.done)
+                        active++;
+                }
+            }
+            std::clog << "\rAdaptive pass " << pass << ": " << active << " pixels remaining   " << std::flush;
+        }
+
+        for (size_t index = 0; index < stats.size(); index++)
+        {
+            framebuffer[index] = stats[index].sum / real(stats[index].count);
+            sample_counts[index] = stats[index].count;
+        }
+    }
+
+    // Adds up to batch_size samples to every unfinished pixel of a tile and updates its error.
+    void sample_tile_adaptive(int x0, int y0, int x1, int y1, int batch_size, std::vector<pixel_statistics> &stats,
+                              const hittable &world) const
+    {
+        std::vector<sample_key> keys;
+        std::vector<color> colors;
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = x0; x < x1; x++)
+            {
+                const pixel_statistics &px = stats[size_t(y) * image_width + x];
+                if (px.done)
+                    continue;
+                int batch_end = std::min(px.count + batch_size, samples_per_pixel);
+                for (int sample = px.count; sample < batch_end; sample++)
+                    keys.push_back({uint32_t(x), uint32_t(y), uint32_t(sample), seed});
+            }
+        }
+        trace_samples(keys, colors, world);
+
+        size_t next = 0;
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = x0; x < x1; x++)
+            {
+                pixel_statistics &px = stats[size_t(y) * image_width + x];
+                if (px.done)
+                    continue;
+
+                int batch_end = std::min(px.count + batch_size, samples_per_pixel);
+                for (; px.count < batch_end; px.count++)
+                {
+                    const color &c = colors[next++];
+                    px.sum += c;
+                    double delta = luminance(c) - px.mean;
+                    px.mean += delta / (px.count + 1);
+                    px.squared_deviations += delta * (luminance(c) - px.mean);
+                }
+                if (px.count >= 2)
+                {
+                    double half_width = 1.96 * std::sqrt(px.squared_deviations / (px.count - 1) / px.count);
+                    px.error = half_width / std::max(px.mean, 0.01);
+                }
+            }
+        }
+    }
+
+    void report_sample_counts(const std::vector<int> &sample_counts) const
+    {
+        double total = 0;
+        for (int count : sample_counts)
+            total += count;
+        std::clog << "Adaptive sampling: " << total / double(sample_counts.size()) << " samples per pixel on average ("
+                  << adaptive_min_spp << " to " << samples_per_pixel << ")\n";
+
+        if (sample_count_file.empty())
+            return;
+
+        // Grey levels scaled so samples_per_pixel is white
+        std::ofstream out(sample_count_file);
+        if (!out)
+        {
+            std::cerr << "ERROR: Could not write sample count map '" << sample_count_file << "'.\n";
+            return;
+        }
+        out << "P3\n" << image_width << " " << image_height << "\n255\n";
+        for (int count : sample_counts)
+        {
+            int level = std::min(255, int(255.0 * count / samples_per_pixel + 0.5));
+            out << level << ' ' << level << ' ' << level << '\n';
+        }
+    }
+
     ray get_ray(int i, int j) const
     {
         // Construct a camera ray originating from the origin and directed at randomly sampled
@@ -196,37 +557,316 @@ private:
     vec3 sample_square() const
     {
         // Returns the vector to a random point in the [-.5,-.5]-[+.5,+.5] unit square.
-        return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+        double u, v;
+        random_2d(u, v);
+        return vec3(u - 0.5, v - 0.5, 0);
     }
 
-    color ray_color(const ray &r, int depth, const hittable &world) const
+    // Where a ray was scattered from, when that bounce also sampled the lights directly. An
+    // emitter or sky the ray reaches has its light weighted against that light sample.
+    struct light_sampled_vertex
+    {
+        point3 p;
+        vec3 n;        // Zero in volumes, as passed to emitter_list
+        real bsdf_pdf; // Density the material drew the ray's direction with
+    };
+
+    // One camera path in flight: the ray to trace next, the fraction of light it still carries
+    // back to the camera, the light gathered so far and its bounce counts.
+    struct path_state
+    {
+        ray r;
+        color throughput = color(1, 1, 1);
+        color radiance = color(0, 0, 0);
+        int depth = 0; // Segments traced so far
+        int bounces[3] = {0, 0, 0}; // Per scatter_lobe
+        bool after_light_sample = false;
+        light_sampled_vertex from; // Valid if after_light_sample
+        real cone_width = 0;       // Width of the ray's footprint at its origin
+    };
+
+    // Traces path.r, adds the light found at its end, and sets up the next segment. Returns false
+    // once the path has ended.
+    bool trace_path_segment(path_state &path, const hittable &world) const
     {
-        // If we've exceeded the ray bounce limit, no more light is gathered.
-        if (depth <= 0)
-            return color(0, 0, 0);
-
         hit_record rec;
+        bool found = intersect(path.r, world, rec);
+        return shade_path_hit(path, found, rec, world);
+    }
 
-        // If the ray hits nothing, return the background
-        if (!world.hit(r, interval(0.001, infinity), rec))
+    static bool intersect(const ray &r, const hittable &world, hit_record &rec)
+    {
+        // Rays start off the surface they leave (see offset_ray_origin), so the whole ray from
+        // t = 0 is searched.
+        rec.uv_scale = 0;
+        if (!world.hit(r, interval(0, infinity), rec))
+            return false;
+        finalize_hit(r, rec);
+        return true;
+    }
+
+    // Second half of trace_path_segment(), given what path.r hit, if found.
+    bool shade_path_hit(path_state &path, bool found, hit_record &rec, const hittable &world) const
+    {
+        const ray &r = path.r;
+        const light_sampled_vertex *from = path.after_light_sample ? &path.from : nullptr;
+
+        // If the ray hits nothing, add the background.
+        if (!found)
         {
-            if (skybox)
-                return skybox->sample(r.direction);
-            if (std::holds_alternative<color>(background))
-                return std::get<color>(background);
-            return color(0, 0, 0); // fallback
+            path.radiance += path.throughput * background_color(r, from);
+            return false;
         }
+        path.depth++;
 
-        ray scattered;
-        color attenuation;
-        color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+        // The ray cone's footprint. An oblique hit stretches it along one axis only, so the
+        // width is the geometric mean of the two.
+        path.cone_width += pixel_spread * rec.t * r.direction.length();
+        real cosine = std::fabs(dot(unit_vector(r.direction), rec.normal));
+        rec.uv_footprint = rec.uv_scale * path.cone_width / std::sqrt(std::fmax(cosine, real(1e-3)));
 
-        if (!rec.mat->scatter(r, rec, attenuation, scattered))
-            return color_from_emission;
+        const material &mat = (*materials)[rec.mat];
+        color color_from_emission = mat.emitted(rec.u, rec.v, rec.p);
+        if (from && emitters.contains(rec.object))
+        {
+            real light_pdf = (1 - environment_pmf) * emitters.pmf(from->p, from->n, rec.object) *
+                             rec.object->pdf_value(r.origin, r.direction);
+            color_from_emission = color_from_emission * mis_weight(from->bsdf_pdf, light_pdf);
+        }
+        path.radiance += path.throughput * color_from_emission;
+
+        // Light gathered after this segment only counts if another segment is allowed.
+        if (path.depth >= max_depth)
+            return false;
+
+        scatter_sample s;
+        if (!mat.sample(r, rec, s))
+            return false;
+
+        // Light sampling stands in for a diffuse bounce, so it obeys the same limits.
+        bool sampled_lights = sample_lights && !mat.is_specular() && below_limit(path, scatter_lobe::diffuse) &&
+                              (!emitters.empty() || environment_pmf > 0);
+        if (sampled_lights)
+        {
+            path.radiance += path.throughput * sample_direct_light(r, rec, mat, world);
+            path.from = {rec.p, mat.is_volumetric() ? vec3(0, 0, 0) : rec.normal, s.pdf};
+        }
+        path.after_light_sample = sampled_lights && !s.is_specular;
+
+        if (!below_limit(path, s.lobe))
+            return false;
+        path.bounces[int(s.lobe)]++;
+        path.throughput = path.throughput * s.weight;
+
+        // Russian roulette: past the first few bounces, end paths that carry little light with a
+        // probability that grows as their throughput falls, and boost the survivors to match.
+        if (path.depth >= russian_roulette_depth)
+        {
+            real survival = std::min(real(0.95), std::max({path.throughput.x, path.throughput.y, path.throughput.z}));
+            if (random_double() >= survival)
+                return false;
+            path.throughput = path.throughput / survival;
+        }
+
+        path.r = ray(offset_ray_origin(rec.p, rec.p_error, rec.geometric_normal, s.direction), s.direction, r.time);
+        return true;
+    }
+
+    // Buffers of one wavefront batch, kept per thread between batches. Each path's sample stream
+    // is saved while other paths run, so it draws the same values as when traced on its own.
+    struct wavefront_batch
+    {
+        std::vector<path_state> paths;
+        std::vector<rng_stream> streams;
+        std::vector<hit_record> hits;
+        std::vector<uint8_t> found;
+        std::vector<uint32_t> active; // Paths still going, in the order the next stage runs them
+        std::vector<uint32_t> keys;   // Sort key per path
+        std::vector<uint32_t> scratch;
+    };
+
+    void trace_wavefront(const std::vector<sample_key> &samples, size_t begin, size_t end, std::vector<color> &colors,
+                         const hittable &world) const
+    {
+        thread_local wavefront_batch batch;
+        const size_t count = end - begin;
+        batch.paths.assign(count, path_state());
+        batch.streams.resize(count);
+        batch.hits.resize(count);
+        batch.found.resize(count);
+        batch.keys.resize(count);
+        batch.active.clear();
+
+        rng_stream &stream = thread_rng();
+
+        // Generate camera rays.
+        for (uint32_t i = 0; i < count; i++)
+        {
+            const sample_key &key = samples[begin + i];
+            stream.start(key, pixel_sampler.get());
+            batch.paths[i].r = get_ray(int(key.x), int(key.y));
+            batch.streams[i] = stream;
+            if (max_depth > 0)
+                batch.active.push_back(i);
+        }
+
+        const int material_bits = wavefront::key_bits(uint32_t(materials->size()));
+        for (bool primary = true; !batch.active.empty(); primary = false)
+        {
+            // Camera rays are already coherent; order bounce rays by direction and origin.
+            if (!primary)
+            {
+                for (uint32_t i : batch.active)
+                    batch.keys[i] = wavefront::ray_key(batch.paths[i].r, world_bounds);
+                wavefront::sort_by_key(batch.active, batch.keys, 30, batch.scratch);
+            }
+
+            // Intersect; camera rays of neighbouring samples go in packets.
+            if (primary)
+            {
+                for (size_t first = 0; first < batch.active.size(); first += ray_packet_size)
+                {
+                    const int lanes = int(std::min(batch.active.size() - first, size_t(ray_packet_size)));
+                    ray_packet packet;
+                    hit_record recs[ray_packet_size];
+                    for (int k = 0; k < lanes; k++)
+                    {
+                        packet.rays[k] = batch.paths[batch.active[first + k]].r;
+                        packet.streams[k] = &batch.streams[batch.active[first + k]];
+                    }
+                    unsigned found = intersect_camera_rays(packet, (1u << lanes) - 1, recs, world);
+                    for (int k = 0; k < lanes; k++)
+                    {
+                        batch.hits[batch.active[first + k]] = recs[k];
+                        batch.found[batch.active[first + k]] = (found >> k) & 1;
+                    }
+                }
+            }
+            else
+            {
+                for (uint32_t i : batch.active)
+                {
+                    stream = batch.streams[i];
+                    batch.found[i] = intersect(batch.paths[i].r, world, batch.hits[i]);
+                    batch.streams[i] = stream;
+                }
+            }
 
-        color color_from_scatter = attenuation * ray_color(scattered, depth - 1, world);
+            // Sort by material, misses first, so each material's shading runs back to back.
+            for (uint32_t i : batch.active)
+                batch.keys[i] = batch.found[i] ? uint32_t(batch.hits[i].mat) + 1 : 0;
+            wavefront::sort_by_key(batch.active, batch.keys, material_bits, batch.scratch);
+
+            // Shade, then compact the paths that go on to the front of the list.
+            size_t alive = 0;
+            for (uint32_t i : batch.active)
+            {
+                stream = batch.streams[i];
+                if (shade_path_hit(batch.paths[i], batch.found[i], batch.hits[i], world))
+                    batch.active[alive++] = i;
+                batch.streams[i] = stream;
+            }
+            batch.active.resize(alive);
+        }
+
+        for (size_t i = 0; i < count; i++)
+            colors[begin + i] = batch.paths[i].radiance;
+    }
+
+    bool below_limit(const path_state &path, scatter_lobe lobe) const
+    {
+        int limit = lobe == scatter_lobe::diffuse    ? max_diffuse_depth
+                    : lobe == scatter_lobe::specular ? max_specular_depth
+                                                     : max_transmission_depth;
+        return limit < 0 || path.bounces[int(lobe)] < limit;
+    }
+
+    color background_color(const ray &r, const light_sampled_vertex *from) const
+    {
+        if (skybox)
+        {
+            color sky = skybox->sample(r.direction);
+            if (from && environment_pmf > 0)
+                sky = sky * mis_weight(from->bsdf_pdf, environment_pmf * skybox->pdf(r.direction));
+            return sky;
+        }
+        if (std::holds_alternative<color>(background))
+            return std::get<color>(background);
+        return color(0, 0, 0); // fallback
+    }
+
+    static constexpr real shadow_epsilon = real(1e-4); // Fraction of a shadow ray left out at the light
+
+    real mis_weight(real pdf, real other_pdf) const
+    {
+        // Weight of a sample drawn with density pdf, when other_pdf could have drawn it too.
+        if (mis == mis_heuristic::power)
+        {
+            pdf *= pdf;
+            other_pdf *= other_pdf;
+        }
+        return pdf + other_pdf > 0 ? pdf / (pdf + other_pdf) : 0;
+    }
+
+    color sample_direct_light(const ray &r, const hit_record &rec, const material &mat, const hittable &world) const
+    {
+        // Pick the sky or one emitter, and a direction towards it, then trace a shadow ray. The
+        // light only counts if the ray escapes to the sky, or first hits the chosen emitter.
+        real u = random_double();
+        if (u < environment_pmf)
+            return sample_environment_light(r, rec, mat, world);
+        u = std::min((u - environment_pmf) / (1 - environment_pmf), real(1) - std::numeric_limits<real>::epsilon());
+
+        real pick_pmf;
+        vec3 n = mat.is_volumetric() ? vec3(0, 0, 0) : rec.normal;
+        const hittable *light = emitters.sample(rec.p, n, u, pick_pmf);
+        if (!light)
+            return color(0, 0, 0);
+
+        vec3 to_light = light->random(rec.p);
+        if (to_light.length_squared() == 0)
+            return color(0, 0, 0);
+        to_light = unit_vector(to_light);
+
+        color f = mat.eval(r, rec, to_light);
+        if (f.x <= 0 && f.y <= 0 && f.z <= 0)
+            return color(0, 0, 0);
+
+        ray shadow(offset_ray_origin(rec.p, rec.p_error, rec.geometric_normal, to_light), to_light, r.time);
+        real light_pdf = light->pdf_value(shadow.origin, to_light);
+        if (light_pdf <= 0)
+            return color(0, 0, 0);
+
+        // Find where the ray meets the light, then check that nothing blocks it on the way. The
+        // shadow ray stops a little short so the light itself can't block it.
+        hit_record light_rec;
+        if (!light->hit(shadow, interval(0, infinity), light_rec) ||
+            world.occluded(shadow, interval(0, light_rec.t * (1 - shadow_epsilon))))
+            return color(0, 0, 0);
+        finalize_hit(shadow, light_rec);
+
+        color emitted = (*materials)[light_rec.mat].emitted(light_rec.u, light_rec.v, light_rec.p);
+        light_pdf *= (1 - environment_pmf) * pick_pmf;
+        return f * emitted * (mis_weight(light_pdf, mat.pdf(r, rec, to_light)) / light_pdf);
+    }
+
+    color sample_environment_light(const ray &r, const hit_record &rec, const material &mat, const hittable &world) const
+    {
+        real sky_pdf;
+        vec3 to_sky = skybox->sample_direction(sky_pdf);
+        if (sky_pdf <= 0)
+            return color(0, 0, 0);
+
+        color f = mat.eval(r, rec, to_sky);
+        if (f.x <= 0 && f.y <= 0 && f.z <= 0)
+            return color(0, 0, 0);
+
+        ray shadow(offset_ray_origin(rec.p, rec.p_error, rec.geometric_normal, to_sky), to_sky, r.time);
+        if (world.occluded(shadow, interval(0, infinity)))
+            return color(0, 0, 0);
 
-        return color_from_emission + color_from_scatter;
+        real light_pdf = environment_pmf * sky_pdf;
+        return f * skybox->sample(to_sky) * (mis_weight(light_pdf, mat.pdf(r, rec, to_sky)) / light_pdf);
     }
 
     point3 defocus_disk_sample() const
@@ -237,21 +877,21 @@ private:
     }
 
     // Euler Rotation helpers
-    static vec3 rot_x(const vec3 &p, double a)
+    static vec3 rot_x(const vec3 &p, real a)
     {
-        double c = std::cos(a), s = std::sin(a);
+        real c = std::cos(a), s = std::sin(a);
         return vec3(p.x, c * p.y - s * p.z, s * p.y + c * p.z);
     }
 
-    static vec3 rot_y(const vec3 &p, double a)
+    static vec3 rot_y(const vec3 &p, real a)
     {
-        double c = std::cos(a), s = std::sin(a);
+        real c = std::cos(a), s = std::sin(a);
         return vec3(c * p.x + s * p.z, p.y, -s * p.x + c * p.z);
     }
 
-    static vec3 rot_z(const vec3 &p, double a)
+    static vec3 rot_z(const vec3 &p, real a)
     {
-        double c = std::cos(a), s = std::sin(a);
+        real c = std::cos(a), s = std::sin(a);
         return vec3(c * p.x - s * p.y, s * p.x + c * p.y, p.z);
     }
 
@@ -7,7 +7,13 @@
 
 using color = vec3;
 
-inline double linear_to_gamma(double linear_component)
+// Relative luminance of a linear color (Rec. 709 primaries).
+inline real luminance(const color &c)
+{
+    return real(0.2126) * c.x + real(0.7152) * c.y + real(0.0722) * c.z;
+}
+
+inline real linear_to_gamma(real linear_component)
 {
     if (linear_component > 0)
         return std::sqrt(linear_component);
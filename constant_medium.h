@@ -8,14 +8,14 @@
 class constant_medium : public hittable
 {
 public:
-    constant_medium(shared_ptr<hittable> boundary_input, double density, shared_ptr<texture> tex)
+    constant_medium(shared_ptr<hittable> boundary_input, real density, shared_ptr<texture> tex)
     {
         boundary = boundary_input;
         neg_inv_density = -1 / density;
         phase_function = make_shared<isotropic>(tex);
     }
 
-    constant_medium(shared_ptr<hittable> boundary_input, double density, const color &albedo)
+    constant_medium(shared_ptr<hittable> boundary_input, real density, const color &albedo)
     {
         boundary = boundary_input;
         neg_inv_density = -1 / density;
@@ -54,18 +54,25 @@ public:
         rec.p = r.at(rec.t);
 
         rec.normal = vec3(1, 0, 0); // arbitrary
+        rec.geometric_normal = rec.normal;
+        rec.p_error = 0;
         rec.front_face = true;      // also arbitrary
-        rec.mat = phase_function;
+        rec.mat = phase_function_id;
+        rec.object = this;
+        rec.instance_depth = 0;
 
         return true;
     }
 
     aabb bounding_box() const override { return boundary->bounding_box(); }
 
+    void register_materials(material_table &table) override { phase_function_id = table.add(phase_function); }
+
 private:
     shared_ptr<hittable> boundary;
-    double neg_inv_density;
+    real neg_inv_density;
     shared_ptr<material> phase_function;
+    material_id phase_function_id = 0;
 };
 
 #endif
\ No newline at end of file
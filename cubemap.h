@@ -3,7 +3,9 @@
 
 #include "raytracer.h"
 #include "rtw_stb_image.h"
+#include "alias_table.h"
 
+#include <algorithm>
 #include <array>
 #include <cmath>
 #include <iostream>
@@ -23,12 +25,95 @@ public:
         if (!valid)
             return color(1, 0, 1); // debug magenta
 
-        vec3 d = unit_vector(dir);
+        int face;
+        real u, v;
+        face_coordinates(dir, face, u, v);
 
-        double ax = std::fabs(d.x), ay = std::fabs(d.y), az = std::fabs(d.z);
+        const int w = faces[face].width();
+        const int h = faces[face].height();
+        if (w <= 0 || h <= 0)
+            return color(1, 0, 1);
+
+        int i = static_cast<int>(u * w);
+        int j = static_cast<int>(v * h);
+
+        // Full-range texels, so HDR skies keep their bright regions.
+        float p[3];
+        faces[face].texel(0, i, j, p);
+        return color(p[0], p[1], p[2]);
+    }
+
+    // True if sample_direction() can be used: the sky is loaded and not black everywhere.
+    bool can_sample_directions() const { return valid && !distribution.empty(); }
+
+    // Direction drawn in proportion to the sky's luminance (times solid angle), with pdf set to
+    // its solid angle density. Requires can_sample_directions().
+    vec3 sample_direction(real &pdf) const
+    {
+        real cell_pmf;
+        size_t cell = distribution.sample(random_double(), cell_pmf);
 
         int face = 0;
-        double u = 0, v = 0;
+        while (face < 5 && cell >= face_cells[face + 1])
+            face++;
+        const size_t local = cell - face_cells[face];
+        const int ci = int(local % size_t(cells_x[face]));
+        const int cj = int(local / size_t(cells_x[face]));
+
+        // Uniform over the cell's area on the face
+        double du, dv;
+        random_2d(du, dv);
+        real u = (ci + du) / cells_x[face];
+        real v = (cj + dv) / cells_y[face];
+        real a = 2 * u - 1, b = 1 - 2 * v;
+
+        pdf = cell_pmf * area_to_solid_angle(face, a, b);
+        return unit_vector(face_direction(face, a, b));
+    }
+
+    // Density with which sample_direction() returns dir.
+    real pdf(const vec3 &dir) const
+    {
+        if (!can_sample_directions())
+            return 0;
+
+        int face;
+        real u, v;
+        face_coordinates(dir, face, u, v);
+        const int ci = std::min(int(u * cells_x[face]), cells_x[face] - 1);
+        const int cj = std::min(int(v * cells_y[face]), cells_y[face] - 1);
+        const size_t cell = face_cells[face] + size_t(cj) * size_t(cells_x[face]) + size_t(ci);
+        return distribution.pmf(cell) * area_to_solid_angle(face, 2 * u - 1, 1 - 2 * v);
+    }
+
+private:
+    enum FaceIndex
+    {
+        POS_X = 0,
+        NEG_X = 1,
+        POS_Y = 2,
+        NEG_Y = 3,
+        POS_Z = 4,
+        NEG_Z = 5
+    };
+
+    std::array<rtw_image, 6> faces;
+    bool valid = false;
+
+    // Importance sampling works on a grid of cells over each face, at most this many on a side;
+    // bright texels still pull up the probability of their cell.
+    static constexpr int max_sampling_cells = 256;
+    int cells_x[6] = {}, cells_y[6] = {};
+    size_t face_cells[7] = {}; // Index of each face's first cell in the distribution
+    alias_table distribution;
+
+    // Face and texture coordinates in [0,1] of direction dir, flipped vertically to match the
+    // image_texture convention.
+    static void face_coordinates(const vec3 &dir, int &face, real &u, real &v)
+    {
+        vec3 d = unit_vector(dir);
+
+        real ax = std::fabs(d.x), ay = std::fabs(d.y), az = std::fabs(d.z);
 
         // Face selection by dominant axis (OpenGL-style cube map convention).
         if (ax >= ay && ax >= az)
@@ -86,33 +171,75 @@ public:
 
         // Match your image_texture convention (flip V)
         v = 1.0 - v;
+    }
 
-        const int w = faces[face].width();
-        const int h = faces[face].height();
-        if (w <= 0 || h <= 0)
-            return color(1, 0, 1);
-
-        int i = static_cast<int>(u * w);
-        int j = static_cast<int>(v * h);
+    // Inverse of face_coordinates() before the remapping: the (unnormalized) direction through
+    // point (a, b) in [-1,1]^2 of a face.
+    static vec3 face_direction(int face, real a, real b)
+    {
+        switch (face)
+        {
+        case POS_X:
+            return vec3(1, b, -a);
+        case NEG_X:
+            return vec3(-1, b, a);
+        case POS_Y:
+            return vec3(a, 1, -b);
+        case NEG_Y:
+            return vec3(a, -1, b);
+        case POS_Z:
+            return vec3(a, b, 1);
+        default:
+            return vec3(-a, b, -1);
+        }
+    }
 
-        const unsigned char *p = faces[face].pixel_data(i, j);
-        const double s = 1.0 / 255.0;
-        return color(s * p[0], s * p[1], s * p[2]);
+    // Converts a density that is uniform over a face's cells to solid angle at point (a, b):
+    // a cell spans 4 / (cells_x * cells_y) of the face, and face area maps to solid angle by
+    // 1 / (1 + a^2 + b^2)^(3/2).
+    real area_to_solid_angle(int face, real a, real b) const
+    {
+        real d2 = 1 + a * a + b * b;
+        return real(cells_x[face]) * real(cells_y[face]) / 4 * d2 * std::sqrt(d2);
     }
 
-private:
-    enum FaceIndex
+    void build_distribution()
     {
-        POS_X = 0,
-        NEG_X = 1,
-        POS_Y = 2,
-        NEG_Y = 3,
-        POS_Z = 4,
-        NEG_Z = 5
-    };
+        // Weight each cell by its mean texel luminance times the solid angle it covers.
+        std::vector<real> weights;
+        for (int face = 0; face < 6; face++)
+        {
+            const int w = faces[face].width(), h = faces[face].height();
+            cells_x[face] = std::max(1, std::min(w, max_sampling_cells));
+            cells_y[face] = std::max(1, std::min(h, max_sampling_cells));
+            face_cells[face] = weights.size();
 
-    std::array<rtw_image, 6> faces;
-    bool valid = false;
+            for (int cj = 0; cj < cells_y[face]; cj++)
+            {
+                const int y0 = cj * h / cells_y[face], y1 = std::max(y0 + 1, (cj + 1) * h / cells_y[face]);
+                for (int ci = 0; ci < cells_x[face]; ci++)
+                {
+                    const int x0 = ci * w / cells_x[face], x1 = std::max(x0 + 1, (ci + 1) * w / cells_x[face]);
+                    double sum = 0;
+                    for (int y = y0; y < y1; y++)
+                    {
+                        for (int x = x0; x < x1; x++)
+                        {
+                            float p[3];
+                            faces[face].texel(0, x, y, p);
+                            sum += luminance(color(p[0], p[1], p[2]));
+                        }
+                    }
+                    real a = 2 * (ci + real(0.5)) / cells_x[face] - 1;
+                    real b = 1 - 2 * (cj + real(0.5)) / cells_y[face];
+                    real mean = real(sum / (double(y1 - y0) * double(x1 - x0)));
+                    weights.push_back(std::max(mean, real(0)) / area_to_solid_angle(face, a, b));
+                }
+            }
+        }
+        face_cells[6] = weights.size();
+        distribution = alias_table(weights);
+    }
 
     static bool try_load_with_exts(rtw_image &img, const std::string &no_ext_path)
     {
@@ -156,6 +283,8 @@ private:
         ok &= load_face(NEG_Z, paths("negz"));
 
         valid = ok;
+        if (valid)
+            build_distribution();
         if (!valid)
         {
             std::cerr << "ERROR: Could not load cubemap '" << name
@@ -0,0 +1,218 @@
+#ifndef EMITTERS_H
+#define EMITTERS_H
+
+#include "hittable.h"
+#include "light_bounds.h"
+
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+// The emissive primitives of a scene that can be sampled directly: each must implement
+// pdf_value(), random() and emitter_bounds(). Emitters nested inside transforms are not
+// collected; they are still found by paths that hit them.
+//
+// Emitters are picked through a light tree: a binary hierarchy over their light_bounds, walked
+// from the root by choosing each child in proportion to its estimated contribution to the
+// shading point. Lights that are far away, small, or facing away are rarely picked, so the
+// noise of a bounce depends little on how many lights the scene has.
+class emitter_list
+{
+public:
+    void collect(const hittable &world)
+    {
+        emitters.clear();
+        nodes.clear();
+        parents.clear();
+        leaf_nodes.clear();
+        world.collect_emitters(emitters);
+        if (emitters.empty())
+            return;
+
+        std::vector<build_item> items(emitters.size());
+        for (size_t i = 0; i < emitters.size(); i++)
+            items[i] = {emitters[i]->emitter_bounds(), uint32_t(i)};
+        build(items, 0, items.size(), UINT32_MAX);
+    }
+
+    bool empty() const { return emitters.empty(); }
+    size_t size() const { return emitters.size(); }
+
+    // Whether hits on object are already accounted for by direct light sampling.
+    bool contains(const hittable *object) const { return leaf_nodes.count(object) > 0; }
+
+    // Picks an emitter for a shading point p with normal n (zero for points in a volume), using a
+    // uniform u in [0,1). pmf is the probability it was picked with. Returns nullptr if no
+    // emitter can light p.
+    const hittable *sample(const point3 &p, const vec3 &n, real u, real &pmf) const
+    {
+        pmf = 0;
+        if (nodes.empty() || nodes[0].bounds.importance(p, n) <= 0)
+            return nullptr;
+
+        pmf = 1;
+        uint32_t index = 0;
+        while (!nodes[index].leaf)
+        {
+            const uint32_t left = index + 1, right = nodes[index].index;
+            real left_importance = nodes[left].bounds.importance(p, n);
+            real right_importance = nodes[right].bounds.importance(p, n);
+            if (left_importance <= 0 && right_importance <= 0)
+            {
+                pmf = 0;
+                return nullptr;
+            }
+
+            // Reuse u for the next choice by rescaling it into [0,1).
+            real left_prob = left_importance / (left_importance + right_importance);
+            if (u < left_prob)
+            {
+                index = left;
+                pmf *= left_prob;
+                u = std::min(u / left_prob, one_minus_epsilon);
+            }
+            else
+            {
+                index = right;
+                pmf *= 1 - left_prob;
+                u = std::min((u - left_prob) / (1 - left_prob), one_minus_epsilon);
+            }
+        }
+        return emitters[nodes[index].index];
+    }
+
+    // Probability that sample(p, n, ...) picks light.
+    real pmf(const point3 &p, const vec3 &n, const hittable *light) const
+    {
+        auto found = leaf_nodes.find(light);
+        if (found == leaf_nodes.end() || nodes[0].bounds.importance(p, n) <= 0)
+            return 0;
+
+        real result = 1;
+        for (uint32_t child = found->second; parents[child] != UINT32_MAX; child = parents[child])
+        {
+            const uint32_t parent = parents[child];
+            real left_importance = nodes[parent + 1].bounds.importance(p, n);
+            real right_importance = nodes[nodes[parent].index].bounds.importance(p, n);
+            real child_importance = (child == parent + 1) ? left_importance : right_importance;
+            if (child_importance <= 0)
+                return 0;
+            result *= child_importance / (left_importance + right_importance);
+        }
+        return result;
+    }
+
+private:
+    // Interior nodes are followed by their first child; index is the second child. Leaves hold
+    // the emitter index.
+    struct tree_node
+    {
+        light_bounds bounds;
+        uint32_t index;
+        bool leaf;
+    };
+
+    struct build_item
+    {
+        light_bounds bounds;
+        uint32_t emitter;
+    };
+
+    static constexpr int bin_count = 12;
+    static constexpr real one_minus_epsilon = real(1) - std::numeric_limits<real>::epsilon();
+
+    std::vector<const hittable *> emitters;
+    std::vector<tree_node> nodes;
+    std::vector<uint32_t> parents;                           // Per node, UINT32_MAX at the root
+    std::unordered_map<const hittable *, uint32_t> leaf_nodes; // Emitter to its leaf
+
+    uint32_t build(std::vector<build_item> &items, size_t begin, size_t end, uint32_t parent)
+    {
+        const uint32_t node = uint32_t(nodes.size());
+        nodes.push_back({});
+        parents.push_back(parent);
+
+        if (end - begin == 1)
+        {
+            nodes[node] = {items[begin].bounds, items[begin].emitter, true};
+            leaf_nodes[emitters[items[begin].emitter]] = node;
+            return node;
+        }
+
+        light_bounds all;
+        aabb centroids = aabb::empty;
+        for (size_t i = begin; i < end; i++)
+        {
+            all = light_bounds::merge(all, items[i].bounds);
+            point3 c = items[i].bounds.centroid();
+            centroids = aabb(centroids, aabb(c, c));
+        }
+
+        // Binned split on the centroids, minimizing the surface area orientation heuristic.
+        const real extents[3] = {all.box.x.size(), all.box.y.size(), all.box.z.size()};
+        const real max_extent = std::max({extents[0], extents[1], extents[2]});
+        real best_cost = infinity;
+        int best_axis = -1, best_split = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const interval &range = centroids.axis_interval(axis);
+            if (range.size() <= 0)
+                continue;
+
+            light_bounds bins[bin_count];
+            for (size_t i = begin; i < end; i++)
+            {
+                int bin = bin_of(items[i], axis, range);
+                bins[bin] = light_bounds::merge(bins[bin], items[i].bounds);
+            }
+
+            for (int split = 1; split < bin_count; split++)
+            {
+                light_bounds below, above;
+                for (int b = 0; b < split; b++)
+                    below = light_bounds::merge(below, bins[b]);
+                for (int b = split; b < bin_count; b++)
+                    above = light_bounds::merge(above, bins[b]);
+                if (below.power <= 0 || above.power <= 0)
+                    continue;
+                real cost = below.cost(max_extent, extents[axis]) + above.cost(max_extent, extents[axis]);
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = split;
+                }
+            }
+        }
+
+        size_t mid = begin;
+        if (best_axis >= 0)
+        {
+            const interval range = centroids.axis_interval(best_axis);
+            mid = size_t(std::partition(items.begin() + begin, items.begin() + end,
+                                        [&](const build_item &item)
+                                        { return bin_of(item, best_axis, range) < best_split; }) -
+                         items.begin());
+        }
+        if (mid == begin || mid == end)
+        {
+            // All centroids coincide, or fell in one bin: split the range in half.
+            mid = (begin + end) / 2;
+        }
+
+        build(items, begin, mid, node);
+        uint32_t second = build(items, mid, end, node);
+        nodes[node] = {all, second, false};
+        return node;
+    }
+
+    static int bin_of(const build_item &item, int axis, const interval &range)
+    {
+        real c = item.bounds.centroid()[axis];
+        int bin = int(bin_count * (c - range.min) / range.size());
+        return std::clamp(bin, 0, bin_count - 1);
+    }
+};
+
+#endif
@@ -3,19 +3,47 @@
 
 #include "raytracer.h"
 #include "aabb.h"
+#include "light_bounds.h"
+#include "ray_packet.h"
+
+#include <vector>
 
 class material;
+class material_table;
+class hittable;
+
+// Index of a material in the scene's material_table.
+using material_id = uint32_t;
 
+// Intersection happens in two phases. hit() only decides which primitive is closest and records
+// t, the primitive and where on it the ray landed (object, prim_index, b1, b2), plus the wrappers
+// (instances, translate, rotate_y) it was found under. Once the closest hit is known,
+// finalize_hit() fills in the shading fields: p, the normals, u, v and front_face.
 class hit_record
 {
 public:
-    point3 p;        // point that will be hit
-    vec3 normal;     // vertex normal
-    double t;        // t
-    double u;        // u
-    double v;        // v
-    bool front_face; // true if it is front facing
-    shared_ptr<material> mat;
+    point3 p;              // point that will be hit
+    vec3 normal;           // vertex normal
+    vec3 geometric_normal; // true surface normal, either orientation; used to offset new rays
+    real p_error;          // bound on the rounding error of each coordinate of p
+    real t;                // t
+    real u;                // u
+    real v;                // v
+    bool front_face;       // true if it is front facing
+    material_id mat;       // index into the scene's material_table
+
+    const hittable *object; // primitive to finalize the hit
+    uint32_t prim_index;    // primitive within object, e.g. the triangle of a mesh
+    real b1, b2;            // barycentric coordinates on that primitive
+
+    real uv_scale = 0;     // change of u, v per unit distance along the surface; 0 if unknown
+    real uv_footprint = 0; // width in u, v of the ray's footprint here, for texture filtering
+
+    // Wrappers the hit lies under, innermost first. Primitives clear the list when they record a
+    // hit, and each wrapper the hit passes out through adds itself (see push_instance).
+    static constexpr int max_instance_depth = 4;
+    const hittable *instances[max_instance_depth];
+    int instance_depth = 0;
 
     void set_face_normal(const ray &r, const vec3 &outward_normal) // Sets the hit record normal vector.
     {
@@ -24,6 +52,7 @@ public:
             normal = outward_normal;
         else
             normal = -outward_normal;
+        geometric_normal = normal;
     }
 };
 
@@ -33,8 +62,170 @@ public:
     virtual ~hittable() = default;
     virtual bool hit(const ray &r, interval ray_t, hit_record &rec) const = 0;
     virtual aabb bounding_box() const = 0;
+
+    // hit() for the active lanes of a packet: recs[lane] and packet.ranges[lane] are updated as
+    // hit() would for that lane's ray alone. Returns the mask of lanes that hit. Hierarchies
+    // override this to share node tests between rays; others keep this per-ray default.
+    virtual unsigned hit_packet(ray_packet &packet, unsigned active, hit_record *recs) const;
+
+    // Whether anything blocks r within ray_t, honouring cutout materials as hit() does. The
+    // search may stop at the first hit found and fills in no hit_record, so shadow rays cost less
+    // than closest-hit queries. Primitives with a cheap hit() keep this default.
+    virtual bool occluded(const ray &r, interval ray_t) const
+    {
+        hit_record rec;
+        return hit(r, ray_t, rec);
+    }
+
+    // occluded() for the active lanes of a packet, within packet.ranges. Returns the occluded
+    // lanes.
+    virtual unsigned occluded_packet(ray_packet &packet, unsigned active) const;
+
+    // Fills in the shading fields of a hit this object recorded as rec.object. Hittables that
+    // fill them in hit() already keep this default.
+    virtual void finalize(const ray &r, hit_record &rec) const
+    {
+        (void)r;
+        (void)rec;
+    }
+
+    // Wrappers only: finalizes a hit found under this wrapper, given the ray in the wrapper's
+    // outer space. Moves the ray into object space, finalizes there (finalize_hit) and moves the
+    // shading fields back out, leaving the wrapper as rec.object.
+    virtual void finalize_instance(const ray &r, hit_record &rec) const
+    {
+        (void)r;
+        (void)rec;
+    }
+
+    // Solid angle density of random(origin) producing direction.
+    virtual real pdf_value(const point3 &origin, const vec3 &direction) const
+    {
+        (void)origin;
+        (void)direction;
+        return 0.0;
+    }
+
+    // Returns a random direction from origin towards this object.
+    virtual vec3 random(const point3 &origin) const
+    {
+        (void)origin;
+        return vec3(1, 0, 0);
+    }
+
+    // Appends the emissive primitives that support direct sampling (pdf_value(), random() and
+    // emitter_bounds()).
+    virtual void collect_emitters(std::vector<const hittable *> &emitters) const
+    {
+        (void)emitters;
+    }
+
+    // Position, orientation and power of this object's emission, for the light tree.
+    virtual light_bounds emitter_bounds() const { return light_bounds(); }
+
+    // Adds the materials of this object's primitives to table and keeps their ids, which hit()
+    // reports in hit_record::mat. Objects that group or wrap others pass the call on.
+    virtual void register_materials(material_table &table) { (void)table; }
 };
 
+// Calls test() with the sample stream of one packet lane in place of the thread's stream.
+template <typename Fn>
+bool with_lane_stream(const ray_packet &packet, int lane, Fn &&test)
+{
+    rng_stream *stream = packet.streams[lane];
+    if (stream)
+        std::swap(thread_rng(), *stream);
+    bool result = test();
+    if (stream)
+        std::swap(thread_rng(), *stream);
+    return result;
+}
+
+// hit() for the ray of one packet lane within ray_t, drawing from that lane's sample stream.
+inline bool hit_packet_lane(const hittable &object, ray_packet &packet, int lane, interval ray_t, hit_record &rec)
+{
+    return with_lane_stream(packet, lane, [&] { return object.hit(packet.rays[lane], ray_t, rec); });
+}
+
+// occluded() for the ray of one packet lane within ray_t, drawing from that lane's sample stream.
+inline bool occluded_packet_lane(const hittable &object, const ray_packet &packet, int lane, interval ray_t)
+{
+    return with_lane_stream(packet, lane, [&] { return object.occluded(packet.rays[lane], ray_t); });
+}
+
+inline unsigned hittable::hit_packet(ray_packet &packet, unsigned active, hit_record *recs) const
+{
+    unsigned hits = 0;
+    for (; active; active &= active - 1)
+    {
+        const int lane = lowest_bit(active);
+        if (hit_packet_lane(*this, packet, lane, packet.ranges[lane], recs[lane]))
+        {
+            hits |= 1u << lane;
+            packet.ranges[lane].max = recs[lane].t;
+        }
+    }
+    return hits;
+}
+
+inline unsigned hittable::occluded_packet(ray_packet &packet, unsigned active) const
+{
+    unsigned blocked = 0;
+    for (; active; active &= active - 1)
+    {
+        const int lane = lowest_bit(active);
+        if (occluded_packet_lane(*this, packet, lane, packet.ranges[lane]))
+            blocked |= 1u << lane;
+    }
+    return blocked;
+}
+
+// occluded() for any number of rays, traced as packets of consecutive rays. Sets blocked[i] for
+// rays[i] within ranges[i].
+inline void occluded_batch(const hittable &world, const ray *rays, const interval *ranges, size_t count,
+                           bool *blocked)
+{
+    ray_packet packet;
+    for (size_t first = 0; first < count; first += ray_packet_size)
+    {
+        const int lanes = int(std::min(count - first, size_t(ray_packet_size)));
+        for (int k = 0; k < lanes; k++)
+        {
+            packet.rays[k] = rays[first + k];
+            packet.ranges[k] = ranges[first + k];
+        }
+        const unsigned mask = world.occluded_packet(packet, (1u << lanes) - 1);
+        for (int k = 0; k < lanes; k++)
+            blocked[first + k] = (mask >> k) & 1;
+    }
+}
+
+// Finalizes the closest hit found by hit(), through the wrappers it was found under, outermost
+// first.
+inline void finalize_hit(const ray &r, hit_record &rec)
+{
+    if (rec.instance_depth > 0)
+        rec.instances[--rec.instance_depth]->finalize_instance(r, rec);
+    else
+        rec.object->finalize(r, rec);
+}
+
+// Called by a wrapper whose object just recorded the hit in rec, for a ray r in the wrapper's
+// outer space. Candidate hits are not finalized: the wrapper is only noted in rec, for
+// finalize_hit to work through once the closest hit is known.
+inline void push_instance(const hittable &wrapper, const ray &r, hit_record &rec)
+{
+    if (rec.instance_depth < hit_record::max_instance_depth)
+    {
+        rec.instances[rec.instance_depth++] = &wrapper;
+        return;
+    }
+
+    // Nested too deep to defer: finalize now. The wrapper is left as rec.object, and its
+    // finalize() does nothing, so the hit is not finalized twice.
+    wrapper.finalize_instance(r, rec);
+}
+
 class translate : public hittable
 {
 public:
@@ -54,14 +245,28 @@ public:
         if (!object->hit(offset_r, ray_t, rec))
             return false;
 
+        push_instance(*this, r, rec);
+        return true;
+    }
+
+    void finalize_instance(const ray &r, hit_record &rec) const override
+    {
+        finalize_hit(ray(r.origin - offset, r.direction, r.time), rec);
+        rec.object = this;
+
         // Move the intersection point forwards by the offset
         rec.p += offset;
+    }
 
-        return true;
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return object->occluded(ray(r.origin - offset, r.direction, r.time), ray_t);
     }
 
     aabb bounding_box() const override { return bbox; }
 
+    void register_materials(material_table &table) override { object->register_materials(table); }
+
 private:
     shared_ptr<hittable> object;
     vec3 offset;
@@ -71,7 +276,7 @@ private:
 class rotate_y : public hittable
 {
 public:
-    rotate_y(shared_ptr<hittable> obj, double angle)
+    rotate_y(shared_ptr<hittable> obj, real angle)
     {
         object = obj;
         auto radians = degrees_to_radians(angle);
@@ -111,26 +316,22 @@ public:
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
-
-        // Transform the ray from world space to object space.
-
-        auto origin = point3(
-            (cos_theta * r.origin.x) - (sin_theta * r.origin.z),
-            r.origin.y,
-            (sin_theta * r.origin.x) + (cos_theta * r.origin.z));
-
-        auto direction = vec3(
-            (cos_theta * r.direction.x) - (sin_theta * r.direction.z),
-            r.direction.y,
-            (sin_theta * r.direction.x) + (cos_theta * r.direction.z));
-
-        ray rotated_r(origin, direction, r.time);
+        ray rotated_r = to_object(r);
 
         // Determine whether an intersection exists in object space (and if so, where).
 
         if (!object->hit(rotated_r, ray_t, rec))
             return false;
 
+        push_instance(*this, r, rec);
+        return true;
+    }
+
+    void finalize_instance(const ray &r, hit_record &rec) const override
+    {
+        finalize_hit(to_object(r), rec);
+        rec.object = this;
+
         // Transform the intersection from object space back to world space.
 
         rec.p = point3(
@@ -143,16 +344,40 @@ public:
             rec.normal.y,
             (-sin_theta * rec.normal.x) + (cos_theta * rec.normal.z));
 
-        return true;
+        rec.geometric_normal = vec3(
+            (cos_theta * rec.geometric_normal.x) + (sin_theta * rec.geometric_normal.z),
+            rec.geometric_normal.y,
+            (-sin_theta * rec.geometric_normal.x) + (cos_theta * rec.geometric_normal.z));
     }
 
+    bool occluded(const ray &r, interval ray_t) const override { return object->occluded(to_object(r), ray_t); }
+
     aabb bounding_box() const override { return bbox; }
 
+    void register_materials(material_table &table) override { object->register_materials(table); }
+
 private:
     shared_ptr<hittable> object;
-    double sin_theta;
-    double cos_theta;
+    real sin_theta;
+    real cos_theta;
     aabb bbox;
+
+    ray to_object(const ray &r) const
+    {
+        // Transform the ray from world space to object space.
+
+        auto origin = point3(
+            (cos_theta * r.origin.x) - (sin_theta * r.origin.z),
+            r.origin.y,
+            (sin_theta * r.origin.x) + (cos_theta * r.origin.z));
+
+        auto direction = vec3(
+            (cos_theta * r.direction.x) - (sin_theta * r.direction.z),
+            r.direction.y,
+            (sin_theta * r.direction.x) + (cos_theta * r.direction.z));
+
+        return ray(origin, direction, r.time);
+    }
 };
 
 #endif
\ No newline at end of file
@@ -45,8 +45,58 @@ public:
         return hit_anything;
     }
 
+    unsigned hit_packet(ray_packet &packet, unsigned active, hit_record *recs) const override
+    {
+        hit_record temp_recs[ray_packet_size];
+        unsigned hits = 0;
+
+        // Each object shrinks the ranges of the lanes it hits, so later objects only report
+        // closer hits.
+        for (const auto &object : objects)
+        {
+            unsigned found = object->hit_packet(packet, active, temp_recs);
+            for (unsigned rest = found; rest; rest &= rest - 1)
+                recs[lowest_bit(rest)] = temp_recs[lowest_bit(rest)];
+            hits |= found;
+        }
+
+        return hits;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        for (const auto &object : objects)
+            if (object->occluded(r, ray_t))
+                return true;
+        return false;
+    }
+
+    unsigned occluded_packet(ray_packet &packet, unsigned active) const override
+    {
+        unsigned blocked = 0;
+        for (const auto &object : objects)
+        {
+            if (blocked == active)
+                break;
+            blocked |= object->occluded_packet(packet, active & ~blocked);
+        }
+        return blocked;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
+    void collect_emitters(std::vector<const hittable *> &emitters) const override
+    {
+        for (const auto &object : objects)
+            object->collect_emitters(emitters);
+    }
+
+    void register_materials(material_table &table) override
+    {
+        for (const auto &object : objects)
+            object->register_materials(table);
+    }
+
 private:
     aabb bbox;
 };
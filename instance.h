@@ -0,0 +1,108 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.h"
+#include "transform.h"
+
+// One placement of a shared object (usually a bvh_node or obj acting as a bottom-level BVH)
+// under an arbitrary affine transform. Instances hold only a pointer to the shared object and a
+// pair of matrices, so one mesh can be placed thousands of times; build a bvh_node over the
+// instances to get the top-level hierarchy.
+class instance : public hittable
+{
+public:
+    instance(shared_ptr<hittable> object_input, const affine_transform &object_to_world_input)
+    {
+        object = object_input;
+        object_to_world = object_to_world_input;
+        world_to_object = object_to_world.inverse();
+        bbox = object_to_world.apply_box(object->bounding_box());
+
+        // Largest factor the transform can stretch a per-coordinate error by.
+        error_scale = 0;
+        for (int row = 0; row < 3; row++)
+            error_scale = std::fmax(error_scale, std::fabs(object_to_world.m[row][0]) +
+                                                     std::fabs(object_to_world.m[row][1]) +
+                                                     std::fabs(object_to_world.m[row][2]));
+
+        // Distances on surfaces grow by about the cube root of the volume scale.
+        const real (*m)[4] = object_to_world.m;
+        real det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                   m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                   m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        uv_scale_factor = det != 0 ? 1 / std::cbrt(std::fabs(det)) : 0;
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        // Move the ray into object space.
+        ray local_r = to_object(r);
+
+        if (!object->hit(local_r, ray_t, rec))
+            return false;
+
+        push_instance(*this, r, rec);
+        return true;
+    }
+
+    unsigned hit_packet(ray_packet &packet, unsigned active, hit_record *recs) const override
+    {
+        // The whole packet moves into object space, where the shared object traces it together.
+        ray_packet local = packet;
+        for (unsigned rest = active; rest; rest &= rest - 1)
+            local.rays[lowest_bit(rest)] = to_object(packet.rays[lowest_bit(rest)]);
+
+        unsigned found = object->hit_packet(local, active, recs);
+        for (unsigned rest = found; rest; rest &= rest - 1)
+        {
+            const int lane = lowest_bit(rest);
+            push_instance(*this, packet.rays[lane], recs[lane]);
+            packet.ranges[lane] = local.ranges[lane];
+        }
+        return found;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override { return object->occluded(to_object(r), ray_t); }
+
+    unsigned occluded_packet(ray_packet &packet, unsigned active) const override
+    {
+        ray_packet local = packet;
+        for (unsigned rest = active; rest; rest &= rest - 1)
+            local.rays[lowest_bit(rest)] = to_object(packet.rays[lowest_bit(rest)]);
+        return object->occluded_packet(local, active);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    void register_materials(material_table &table) override { object->register_materials(table); }
+
+    void finalize_instance(const ray &r, hit_record &rec) const override
+    {
+        finalize_hit(to_object(r), rec);
+        rec.object = this;
+
+        // Move the hit back to world space. Normals go through the inverse transpose; this keeps
+        // the sign of dot(direction, normal), so front_face stays valid.
+        rec.p = object_to_world.apply_point(rec.p);
+        rec.normal = unit_vector(world_to_object.apply_transpose(rec.normal));
+        rec.geometric_normal = unit_vector(world_to_object.apply_transpose(rec.geometric_normal));
+        rec.p_error *= error_scale;
+        rec.uv_scale *= uv_scale_factor;
+    }
+
+private:
+    shared_ptr<hittable> object;
+    affine_transform object_to_world;
+    affine_transform world_to_object;
+    real error_scale;
+    real uv_scale_factor; // Converts uv_scale from object to world distances
+    aabb bbox;
+
+    ray to_object(const ray &r) const
+    {
+        // The direction is not renormalized, so t values are the same in both spaces.
+        return ray(world_to_object.apply_point(r.origin), world_to_object.apply_vector(r.direction), r.time);
+    }
+};
+
+#endif
@@ -1,11 +1,13 @@
 #ifndef INTERVAL_H
 #define INTERVAL_H
 
+#include "precision.h"
+
 class interval
 {
 public:
-    double min;
-    double max;
+    real min;
+    real max;
 
     interval()
     {
@@ -13,7 +15,7 @@ public:
         max = infinity;
     }
 
-    interval(double x, double y)
+    interval(real x, real y)
     {
         min = x;
         max = y;
@@ -26,22 +28,22 @@ public:
         max = a.max >= b.max ? a.max : b.max;
     }
 
-    double size() const
+    real size() const
     {
         return max - min;
     }
 
-    bool contains(double x) const
+    bool contains(real x) const
     {
         return min <= x && x <= max;
     }
 
-    bool surrounds(double x) const
+    bool surrounds(real x) const
     {
         return min < x && x < max;
     }
 
-    double clamp(double x) const
+    real clamp(real x) const
     {
         if (x < min)
             return min;
@@ -50,7 +52,7 @@ public:
         return x;
     }
 
-    interval expand(double delta) const
+    interval expand(real delta) const
     {
         auto padding = delta / 2;
         return interval(min - padding, max + padding);
@@ -62,12 +64,12 @@ public:
 const interval interval::empty = interval(+infinity, -infinity);
 const interval interval::universe = interval(-infinity, +infinity);
 
-interval operator+(const interval &ival, double displacement)
+interval operator+(const interval &ival, real displacement)
 {
     return interval(ival.min + displacement, ival.max + displacement);
 }
 
-interval operator+(double displacement, const interval &ival)
+interval operator+(real displacement, const interval &ival)
 {
     return ival + displacement;
 }
@@ -0,0 +1,177 @@
+#ifndef LIGHT_BOUNDS_H
+#define LIGHT_BOUNDS_H
+
+#include "raytracer.h"
+#include "aabb.h"
+
+#include <algorithm>
+
+// Conservative bounds on one or more emitters, used to build and traverse the light tree
+// (emitters.h). The emitters lie in box and emit power in total. Every surface normal lies within
+// theta_o of axis, and light leaves each point within theta_e of its normal (Conty Estevez and
+// Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting", 2018).
+struct light_bounds
+{
+    aabb box = aabb::empty;
+    vec3 axis = vec3(0, 0, 1);
+    real cos_theta_o = 1;
+    real cos_theta_e = 1;
+    real power = 0;
+    bool two_sided = false;
+
+    point3 centroid() const
+    {
+        return point3((box.x.min + box.x.max) / 2, (box.y.min + box.y.max) / 2, (box.z.min + box.z.max) / 2);
+    }
+
+    // Bounds of both a and b.
+    static light_bounds merge(const light_bounds &a, const light_bounds &b)
+    {
+        if (a.power <= 0)
+            return b;
+        if (b.power <= 0)
+            return a;
+
+        light_bounds m;
+        m.box = aabb(a.box, b.box);
+        m.power = a.power + b.power;
+        m.two_sided = a.two_sided || b.two_sided;
+        m.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+        merge_cones(a.axis, a.cos_theta_o, b.axis, b.cos_theta_o, m.axis, m.cos_theta_o);
+        return m;
+    }
+
+    // Estimated contribution to a point p with normal n. A zero n means p is in a volume and
+    // receives light from every direction. The estimate is an upper bound on the cosine factors
+    // over every point and normal the bounds allow, divided by the squared distance.
+    real importance(const point3 &p, const vec3 &n) const
+    {
+        if (power <= 0)
+            return 0;
+
+        point3 pc = centroid();
+        vec3 diagonal(box.x.size(), box.y.size(), box.z.size());
+        real d2 = std::max((p - pc).length_squared(), diagonal.length() / 2);
+
+        // Angle between the cone axis and the direction to p
+        vec3 wi = p - pc;
+        wi = wi.length_squared() > 0 ? unit_vector(wi) : axis;
+        real cos_theta_w = dot(axis, wi);
+        if (two_sided)
+            cos_theta_w = std::fabs(cos_theta_w);
+        real sin_theta_w = safe_sqrt(1 - cos_theta_w * cos_theta_w);
+
+        // Half angle of the cone of directions from p that hit the box
+        real cos_theta_b = bound_subtended_cos(p);
+        real sin_theta_b = safe_sqrt(1 - cos_theta_b * cos_theta_b);
+
+        // Smallest angle between an emitter normal and the direction to p, max(0, w - o - b)
+        real sin_theta_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+        real cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+        real sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+        real cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+        if (cos_theta_p <= cos_theta_e)
+            return 0;
+
+        real result = power * cos_theta_p / d2;
+
+        // Smallest angle between the receiving normal and a direction towards the box
+        if (n.length_squared() > 0)
+        {
+            real cos_theta_i = std::fabs(dot(wi, n));
+            real sin_theta_i = safe_sqrt(1 - cos_theta_i * cos_theta_i);
+            result *= cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+        }
+
+        return std::max(result, real(0));
+    }
+
+    // Surface area orientation cost of a child node with these bounds, for a split along an axis
+    // where the parent's box is axis_extent long (and max_extent along its longest axis).
+    real cost(real max_extent, real axis_extent) const
+    {
+        real theta_o = std::acos(std::clamp(cos_theta_o, real(-1), real(1)));
+        real theta_e = std::acos(std::clamp(cos_theta_e, real(-1), real(1)));
+        real theta_w = std::min(theta_o + theta_e, pi);
+        real sin_theta_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+        real m_omega = 2 * pi * (1 - cos_theta_o) +
+                       pi / 2 * (2 * theta_w * sin_theta_o - std::cos(theta_o - 2 * theta_w) -
+                                 2 * theta_o * sin_theta_o + cos_theta_o);
+
+        // Penalizes thin slabs, which bound lights poorly in the directions they are thin in
+        real k_r = axis_extent > 0 ? max_extent / axis_extent : 1;
+        real area = box.surface_area();
+        return power * m_omega * k_r * (area > 0 ? area : 1);
+    }
+
+private:
+    static real safe_sqrt(real x) { return std::sqrt(std::max(x, real(0))); }
+
+    // cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+    static real cos_sub_clamped(real sin_a, real cos_a, real sin_b, real cos_b)
+    {
+        if (cos_a > cos_b)
+            return 1;
+        return cos_a * cos_b + sin_a * sin_b;
+    }
+
+    static real sin_sub_clamped(real sin_a, real cos_a, real sin_b, real cos_b)
+    {
+        if (cos_a > cos_b)
+            return 0;
+        return sin_a * cos_b - cos_a * sin_b;
+    }
+
+    // Cosine of the half angle of a cone from p that holds the box's bounding sphere; -1 if p is
+    // inside it.
+    real bound_subtended_cos(const point3 &p) const
+    {
+        point3 pc = centroid();
+        vec3 diagonal(box.x.size(), box.y.size(), box.z.size());
+        real radius_squared = diagonal.length_squared() / 4;
+        real d2 = (p - pc).length_squared();
+        if (d2 < radius_squared)
+            return -1;
+        return safe_sqrt(1 - radius_squared / d2);
+    }
+
+    // Smallest cone holding cones (wa, cos_a) and (wb, cos_b).
+    static void merge_cones(const vec3 &wa, real cos_a, const vec3 &wb, real cos_b, vec3 &w, real &cos_theta)
+    {
+        real theta_a = std::acos(std::clamp(cos_a, real(-1), real(1)));
+        real theta_b = std::acos(std::clamp(cos_b, real(-1), real(1)));
+        real theta_d = std::acos(std::clamp(dot(wa, wb), real(-1), real(1)));
+
+        // One cone already holds the other
+        if (std::min(theta_d + theta_b, pi) <= theta_a)
+        {
+            w = wa;
+            cos_theta = cos_a;
+            return;
+        }
+        if (std::min(theta_d + theta_a, pi) <= theta_b)
+        {
+            w = wb;
+            cos_theta = cos_b;
+            return;
+        }
+
+        real theta_o = (theta_a + theta_d + theta_b) / 2;
+        vec3 wr = cross(wa, wb);
+        if (theta_o >= pi || wr.length_squared() == 0)
+        {
+            w = wa;
+            cos_theta = -1;
+            return;
+        }
+
+        // Rotate wa towards wb by theta_o - theta_a about their common perpendicular (Rodrigues).
+        real theta_r = theta_o - theta_a;
+        vec3 k = unit_vector(wr);
+        w = wa * std::cos(theta_r) + cross(k, wa) * std::sin(theta_r) + k * dot(k, wa) * (1 - std::cos(theta_r));
+        w = unit_vector(w);
+        cos_theta = std::cos(theta_o);
+    }
+};
+
+#endif
@@ -0,0 +1,795 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "aabb.h"
+#include "ray_packet.h"
+#include "scheduler.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// How the hierarchy is split. The SAH builder gives the fastest traversal; the LBVH builder sorts
+// primitives along a Morton curve and builds several times faster, at some cost in quality.
+enum class bvh_build_method
+{
+    sah,
+    lbvh
+};
+
+// Settings for the BVH builders.
+struct bvh_build_options
+{
+    bvh_build_method method = bvh_build_method::sah;
+    int build_threads = 0;          // Threads for parallel builds (0 = use all hardware threads)
+    int max_leaf_size = 4;          // Most primitives stored in a single leaf
+    int bin_count = 16;             // Centroid bins evaluated per axis and split
+    double traversal_cost = 1.0;    // Cost of visiting one interior node
+    double intersection_cost = 1.0; // Cost of one ray/primitive test
+    int width = 4;                  // Children per node: 2 (binary), or 4 / 8 (SIMD wide nodes)
+};
+
+// One node of a flattened BVH. Nodes are stored in depth-first order, so the first child of an
+// interior node always directly follows it and only the second child's index is stored.
+struct alignas(32) linear_bvh_node
+{
+    float bounds_min[3]; // Conservatively rounded (outwards) single-precision bounds
+    float bounds_max[3];
+    uint32_t offset;     // Leaf: first primitive slot. Interior: index of the second child
+    uint16_t prim_count; // Number of primitives in a leaf, 0 for interior nodes
+    uint8_t axis;        // Split axis of an interior node
+    uint8_t pad;
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node must stay 32 bytes");
+
+// A BVH over abstract primitives, packed into one contiguous node array. It knows nothing about
+// the primitives themselves: the builder works on their bounding boxes and traversal hands leaf
+// primitive ranges to a caller-supplied intersection function.
+class linear_bvh
+{
+public:
+    std::vector<linear_bvh_node> nodes;
+
+    // Builds the hierarchy over the given primitive boxes. On return, order[slot] is the index
+    // (into prim_bounds) of the primitive that leaves refer to as slot; callers store their
+    // primitives in that order.
+    void build(const std::vector<aabb> &prim_bounds, const bvh_build_options &options,
+               std::vector<uint32_t> &order)
+    {
+        auto start_time = std::chrono::steady_clock::now();
+
+        nodes.clear();
+        order.clear();
+        cost = 0;
+        if (prim_bounds.empty())
+            return;
+
+        std::vector<build_prim> prims(prim_bounds.size());
+        for (size_t i = 0; i < prims.size(); i++)
+        {
+            prims[i].bounds = prim_bounds[i];
+            prims[i].centroid = centroid(prim_bounds[i]);
+            prims[i].index = uint32_t(i);
+        }
+
+        // The first few levels are split a level at a time, enough to cut the primitives into
+        // subtrees that keep every build thread busy; each subtree is then built by one task.
+        build_context ctx{options, 0, nullptr};
+        int threads = work_stealing_scheduler::resolve_thread_count(options.build_threads);
+        while ((1 << ctx.parallel_depth) < threads)
+            ctx.parallel_depth++;
+        if (threads > 1)
+            ctx.parallel_depth += 2;
+
+        nodes.reserve(2 * prims.size());
+        if (options.method == bvh_build_method::lbvh)
+        {
+            std::vector<uint32_t> codes = sort_by_morton_code(prims, threads);
+            ctx.morton_codes = codes.data();
+            cost = build_parallel(prims, ctx, threads, nodes);
+        }
+        else
+        {
+            cost = build_parallel(prims, ctx, threads, nodes);
+        }
+
+        order.resize(prims.size());
+        for (size_t i = 0; i < prims.size(); i++)
+            order[i] = prims[i].index;
+
+        build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    }
+
+    bool empty() const { return nodes.empty(); }
+
+    // Calls visit(first, count) once for every leaf.
+    template <typename Fn>
+    void for_each_leaf(Fn &&visit) const
+    {
+        for (const linear_bvh_node &node : nodes)
+            if (node.prim_count > 0)
+                visit(node.offset, uint32_t(node.prim_count));
+    }
+
+    // Expected SAH cost of tracing a ray through the hierarchy, in units of the build options'
+    // traversal and intersection costs. Lower is better.
+    double sah_cost() const { return cost; }
+
+    // Wall-clock time the last build() took, in seconds.
+    double build_time() const { return build_seconds; }
+
+    // Finds the closest hit along r. intersect_leaf(first, count, ray_t) tests primitive slots
+    // [first, first + count), shrinks ray_t.max to the closest hit it finds and returns whether
+    // it found one. An any-hit test ends the search by setting ray_t to interval::empty. root
+    // limits the search to the subtree of that node.
+    template <typename LeafFn>
+    bool traverse(const ray &r, interval ray_t, LeafFn &&intersect_leaf, uint32_t root = 0) const
+    {
+        if (nodes.empty())
+            return false;
+
+        const real inv_dir[3] = {1 / r.direction.x, 1 / r.direction.y, 1 / r.direction.z};
+        const real orig[3] = {r.origin.x, r.origin.y, r.origin.z};
+        const bool dir_is_neg[3] = {inv_dir[0] < 0, inv_dir[1] < 0, inv_dir[2] < 0};
+
+        uint32_t stack[max_depth];
+        int stack_size = 0;
+        uint32_t current = root;
+        bool hit_anything = false;
+
+        while (true)
+        {
+            const linear_bvh_node &node = nodes[current];
+            if (slab_test(node, orig, inv_dir, ray_t))
+            {
+                if (node.prim_count > 0)
+                {
+                    if (intersect_leaf(node.offset, uint32_t(node.prim_count), ray_t))
+                    {
+                        hit_anything = true;
+                        if (ray_t.max < ray_t.min)
+                            break;
+                    }
+                }
+                else
+                {
+                    // Visit the child nearer along the split axis first; push the other one.
+                    if (dir_is_neg[node.axis])
+                    {
+                        stack[stack_size++] = current + 1;
+                        current = node.offset;
+                    }
+                    else
+                    {
+                        stack[stack_size++] = node.offset;
+                        current = current + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if (stack_size == 0)
+                break;
+            current = stack[--stack_size];
+        }
+
+        return hit_anything;
+    }
+
+    // Finds the closest hit of each active lane of packet, testing every node against all the
+    // rays still inside it at once. A subtree that only one ray enters is finished with
+    // traverse(). intersect_leaf(lane, first, count, ray_t) is traverse()'s leaf test for the ray
+    // of one lane; emptying ray_t ends that lane's search. Shrinks the ranges of lanes that hit
+    // and returns their mask.
+    template <typename LaneLeafFn>
+    unsigned traverse_packet(ray_packet &packet, unsigned active, LaneLeafFn &&intersect_leaf) const
+    {
+        if (nodes.empty() || !active)
+            return 0;
+
+        struct entry
+        {
+            uint32_t node;
+            unsigned mask; // Lanes that entered the parent
+        };
+
+        packet_rays rays(packet, active);
+        entry stack[2 * max_depth];
+        int stack_size = 0;
+        stack[stack_size++] = {0, active};
+        unsigned hits = 0, finished = 0;
+
+        while (stack_size > 0 && finished != active)
+        {
+            const entry e = stack[--stack_size];
+            const linear_bvh_node &node = nodes[e.node];
+            const float *const bmin[3] = {&node.bounds_min[0], &node.bounds_min[1], &node.bounds_min[2]};
+            const float *const bmax[3] = {&node.bounds_max[0], &node.bounds_max[1], &node.bounds_max[2]};
+            unsigned mask;
+            float tnear;
+            packet_kernels::box_test(bmin, bmax, 1, rays, e.mask & ~finished, &mask, &tnear);
+            if (!mask)
+                continue;
+
+            if (node.prim_count > 0 || (mask & (mask - 1)) == 0)
+            {
+                // A leaf, or a subtree only one ray entered: test the rays one by one.
+                for (unsigned rest = mask; rest; rest &= rest - 1)
+                {
+                    const int lane = lowest_bit(rest);
+                    auto lane_leaf = [&](uint32_t first, uint32_t count, interval &t)
+                    { return intersect_leaf(lane, first, count, t); };
+                    interval &t = packet.ranges[lane];
+                    bool found = node.prim_count > 0 ? lane_leaf(node.offset, uint32_t(node.prim_count), t)
+                                                     : traverse_lane(packet.rays[lane], t, lane_leaf, e.node);
+                    if (found)
+                    {
+                        hits |= 1u << lane;
+                        rays.set_tmax(lane, t.max);
+                        if (t.max < t.min)
+                            finished |= 1u << lane;
+                    }
+                }
+                continue;
+            }
+
+            // Visit the child nearer along the split axis for the first ray first.
+            const bool negative = rays.inv_dir[node.axis][lowest_bit(mask)] < 0;
+            stack[stack_size++] = {negative ? e.node + 1 : node.offset, mask};
+            stack[stack_size++] = {negative ? node.offset : e.node + 1, mask};
+        }
+
+        return hits;
+    }
+
+    // traverse() from root, shrinking ray_t to the closest hit found.
+    template <typename LeafFn>
+    bool traverse_lane(const ray &r, interval &ray_t, LeafFn &&intersect_leaf, uint32_t root) const
+    {
+        interval closest = ray_t;
+        auto leaf = [&](uint32_t first, uint32_t count, interval &t)
+        {
+            bool found = intersect_leaf(first, count, t);
+            if (found)
+                closest.max = t.max;
+            return found;
+        };
+        bool found = traverse(r, ray_t, leaf, root);
+        ray_t = closest;
+        return found;
+    }
+
+private:
+    // Depth limit of the traversal stack. Past sah_depth_limit levels the builder switches to
+    // object median splits, which keeps the depth of any tree well within it.
+    static constexpr int max_depth = 64;
+    static constexpr int sah_depth_limit = 24;
+    static constexpr int max_bins = 64;
+
+    // Spans smaller than this are never split across tasks; the task overhead would dominate.
+    static constexpr size_t parallel_span = 4096;
+
+    struct build_context
+    {
+        const bvh_build_options &options;
+        int parallel_depth;            // Levels split before subtrees are handed to tasks
+        const uint32_t *morton_codes; // Sorted Morton codes (LBVH builds only)
+    };
+
+    struct build_prim
+    {
+        aabb bounds;
+        point3 centroid;
+        uint32_t index;
+    };
+
+    struct build_result
+    {
+        aabb bounds;
+        double cost;
+    };
+
+    struct split
+    {
+        int axis = -1;
+        int bin = 0;
+        double cost = infinity;
+    };
+
+    // How build_span divides a span: into a leaf, or into [start, mid) and [mid, end).
+    struct span_split
+    {
+        aabb bounds;
+        double leaf_cost;
+        bool leaf = false;
+        size_t mid = 0;
+        int axis = -1;
+    };
+
+    // A node of the top levels of a parallel build. It is either split into two further top
+    // nodes, or is the root of a subtree built by one task into its own node array.
+    struct top_node
+    {
+        size_t start = 0, end = 0;
+        int depth = 0;
+        span_split split;
+        int left = -1, right = -1; // Children in the top node list, if split here
+        std::vector<linear_bvh_node> nodes;
+        build_result result;
+    };
+
+    struct bin_mapper
+    {
+        // Maps a centroid to the bin it falls in along one axis.
+        int axis;
+        int bins;
+        double min;
+        double scale;
+
+        bin_mapper(const aabb &centroid_bounds, int axis_index, int bin_count)
+        {
+            const interval &extent = centroid_bounds.axis_interval(axis_index);
+            axis = axis_index;
+            bins = bin_count;
+            min = extent.min;
+            scale = bin_count / extent.size();
+        }
+
+        int operator()(const point3 &c) const
+        {
+            int b = int((c[axis] - min) * scale);
+            return std::clamp(b, 0, bins - 1);
+        }
+    };
+
+    double cost = 0;
+    double build_seconds = 0;
+
+    static point3 centroid(const aabb &box)
+    {
+        return point3(0.5 * (box.x.min + box.x.max),
+                      0.5 * (box.y.min + box.y.max),
+                      0.5 * (box.z.min + box.z.max));
+    }
+
+    static int bin_count(const bvh_build_options &options)
+    {
+        return std::clamp(options.bin_count, 2, max_bins);
+    }
+
+    static float round_down(double d)
+    {
+        float f = float(d);
+        return double(f) > d ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+    }
+
+    static float round_up(double d)
+    {
+        float f = float(d);
+        return double(f) < d ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+
+    static bool slab_test(const linear_bvh_node &node, const real orig[3], const real inv_dir[3],
+                          interval ray_t)
+    {
+        // Far distances are scaled up slightly so rounding can't drop a box the ray really
+        // crosses; this matters in single precision builds.
+        constexpr real far_scale = 1 + 4 * std::numeric_limits<real>::epsilon();
+        for (int axis = 0; axis < 3; axis++)
+        {
+            real t0 = (node.bounds_min[axis] - orig[axis]) * inv_dir[axis];
+            real t1 = (node.bounds_max[axis] - orig[axis]) * inv_dir[axis];
+            if (inv_dir[axis] < 0)
+                std::swap(t0, t1);
+            t1 *= far_scale;
+
+            // Written so that NaNs (a zero direction component on a slab plane) leave ray_t as is.
+            if (t0 > ray_t.min)
+                ray_t.min = t0;
+            if (t1 < ray_t.max)
+                ray_t.max = t1;
+
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    double build_parallel(std::vector<build_prim> &prims, const build_context &ctx, int threads,
+                          std::vector<linear_bvh_node> &out) const
+    {
+        // Split the top levels breadth first, every node of a level at once. Spans that are
+        // small or deep enough (or become leaves) are left as subtrees, which are then built
+        // together, each into its own node array, on the same number of threads.
+        std::vector<top_node> top(1);
+        top[0].end = prims.size();
+
+        std::vector<int> level = {0}, subtrees;
+        while (!level.empty())
+        {
+            std::vector<int> splitting;
+            for (int t : level)
+            {
+                if (top[t].depth < ctx.parallel_depth && top[t].end - top[t].start >= parallel_span)
+                    splitting.push_back(t);
+                else
+                    subtrees.push_back(t);
+            }
+
+            // While a level has few nodes, spare threads bin their three axes concurrently.
+            const int tasks = int(splitting.size());
+            const bool parallel_axes = 3 * tasks <= threads;
+            work_stealing_scheduler scheduler(tasks, std::min(tasks, threads));
+            scheduler.run([&](int worker, int task)
+            {
+                (void)worker;
+                top_node &t = top[splitting[task]];
+                t.split = split_span(prims, t.start, t.end, t.depth, ctx, parallel_axes);
+            });
+
+            level.clear();
+            for (int t : splitting)
+            {
+                if (top[t].split.leaf)
+                {
+                    subtrees.push_back(t);
+                    continue;
+                }
+                const int left = int(top.size());
+                top.resize(top.size() + 2);
+                top[left].start = top[t].start;
+                top[left].end = top[left + 1].start = top[t].split.mid;
+                top[left + 1].end = top[t].end;
+                top[left].depth = top[left + 1].depth = top[t].depth + 1;
+                top[t].left = left;
+                top[t].right = left + 1;
+                level.push_back(left);
+                level.push_back(left + 1);
+            }
+        }
+
+        work_stealing_scheduler scheduler(int(subtrees.size()), std::min(int(subtrees.size()), threads));
+        scheduler.run([&](int worker, int task)
+        {
+            (void)worker;
+            top_node &t = top[subtrees[task]];
+            t.nodes.reserve(2 * (t.end - t.start));
+            t.result = build_span(prims, t.start, t.end, t.depth, ctx, t.nodes);
+        });
+
+        return emit_top(top, 0, ctx.options, out).cost;
+    }
+
+    // Appends a top node and everything below it to out, in the same depth-first order
+    // build_span uses. Subtree roots splice in their node arrays.
+    static build_result emit_top(std::vector<top_node> &top, int index, const bvh_build_options &options,
+                                 std::vector<linear_bvh_node> &out)
+    {
+        top_node &t = top[index];
+        const uint32_t base = uint32_t(out.size());
+        if (t.left < 0)
+        {
+            for (linear_bvh_node node : t.nodes)
+            {
+                if (node.prim_count == 0)
+                    node.offset += base;
+                out.push_back(node);
+            }
+            std::vector<linear_bvh_node>().swap(t.nodes);
+            return t.result;
+        }
+
+        out.emplace_back();
+        set_bounds(out[base], t.split.bounds);
+        build_result left = emit_top(top, t.left, options, out);
+        out[base].offset = uint32_t(out.size());
+        build_result right = emit_top(top, t.right, options, out);
+        out[base].prim_count = 0;
+        out[base].axis = uint8_t(t.split.axis);
+        return {t.split.bounds, interior_cost(options, t.split.bounds, left, right)};
+    }
+
+    build_result build_span(std::vector<build_prim> &prims, size_t start, size_t end, int depth,
+                            const build_context &ctx, std::vector<linear_bvh_node> &out) const
+    {
+        span_split s = split_span(prims, start, end, depth, ctx, false);
+
+        const uint32_t node_index = uint32_t(out.size());
+        out.emplace_back();
+        set_bounds(out[node_index], s.bounds);
+        if (s.leaf)
+            return make_leaf(out[node_index], s.bounds, start, end - start, s.leaf_cost);
+
+        build_result left = build_span(prims, start, s.mid, depth + 1, ctx, out);
+        out[node_index].offset = uint32_t(out.size());
+        build_result right = build_span(prims, s.mid, end, depth + 1, ctx, out);
+
+        out[node_index].prim_count = 0;
+        out[node_index].axis = uint8_t(s.axis);
+        return {s.bounds, interior_cost(ctx.options, s.bounds, left, right)};
+    }
+
+    // Decides whether a span becomes a leaf and, if not, partitions it into two children.
+    span_split split_span(std::vector<build_prim> &prims, size_t start, size_t end, int depth,
+                          const build_context &ctx, bool parallel_axes) const
+    {
+        span_split result;
+
+        // Build the bounding box of the span of primitives, and of their centroids.
+        aabb bbox = aabb::empty;
+        aabb centroid_bounds = aabb::empty;
+        for (size_t i = start; i < end; i++)
+        {
+            bbox = aabb(bbox, prims[i].bounds);
+            centroid_bounds = aabb(centroid_bounds, aabb(prims[i].centroid, prims[i].centroid));
+        }
+        result.bounds = bbox;
+
+        const auto &options = ctx.options;
+        size_t span = end - start;
+        double leaf_cost = options.intersection_cost * double(span);
+        size_t max_leaf = size_t(std::clamp(options.max_leaf_size, 1, 0xFFFF));
+        result.leaf_cost = leaf_cost;
+        result.leaf = true;
+
+        size_t mid = start;
+        int axis = -1;
+
+        if (ctx.morton_codes)
+        {
+            // LBVH: primitives are sorted along the Morton curve, so split where the highest
+            // differing bit of the span's codes flips.
+            if (span <= max_leaf)
+                return result;
+            uint32_t first = ctx.morton_codes[start];
+            uint32_t last = ctx.morton_codes[end - 1];
+            if (first != last)
+            {
+                int bit = highest_bit(first ^ last);
+                mid = size_t(std::partition_point(ctx.morton_codes + start, ctx.morton_codes + end,
+                                                  [bit](uint32_t code)
+                                                  { return ((code >> bit) & 1) == 0; }) -
+                             ctx.morton_codes);
+                axis = 2 - bit % 3; // Bits interleave as ...xyz, with z in bit 0
+            }
+        }
+        else
+        {
+            split best;
+            if (span > 1 && depth < sah_depth_limit)
+            {
+                best = find_split(prims, start, end, centroid_bounds, bbox.surface_area(), options, parallel_axes);
+            }
+
+            if (span <= 1 || (span <= max_leaf && leaf_cost <= best.cost))
+                return result;
+
+            // Partition the span around the chosen bin boundary in linear time.
+            axis = best.axis;
+            if (axis >= 0)
+            {
+                bin_mapper bin_of(centroid_bounds, axis, bin_count(options));
+                auto it = std::partition(prims.begin() + start, prims.begin() + end,
+                                         [&](const build_prim &p)
+                                         { return bin_of(p.centroid) <= best.bin; });
+                mid = size_t(it - prims.begin());
+            }
+        }
+
+        if (mid == start || mid == end)
+        {
+            // No usable split (all centroids or codes coincide, or the tree got too deep): fall
+            // back to an object median along the longest axis. nth_element keeps this linear and
+            // leaves equal Morton codes adjacent.
+            axis = centroid_bounds.longest_axis();
+            mid = start + span / 2;
+            if (!ctx.morton_codes)
+                std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+                                 [axis](const build_prim &a, const build_prim &b)
+                                 { return a.centroid[axis] < b.centroid[axis]; });
+        }
+
+        result.leaf = false;
+        result.mid = mid;
+        result.axis = axis;
+        return result;
+    }
+
+    // Expected cost of a random ray that reaches an interior node with the given children.
+    static double interior_cost(const bvh_build_options &options, const aabb &bbox, const build_result &left,
+                                const build_result &right)
+    {
+        double area = bbox.surface_area();
+        if (area > 0)
+            return options.traversal_cost +
+                   (left.bounds.surface_area() * left.cost + right.bounds.surface_area() * right.cost) / area;
+        return options.traversal_cost + left.cost + right.cost;
+    }
+
+    static build_result make_leaf(linear_bvh_node &node, const aabb &bbox, size_t start, size_t span,
+                                  double leaf_cost)
+    {
+        node.offset = uint32_t(start);
+        node.prim_count = uint16_t(span);
+        return {bbox, leaf_cost};
+    }
+
+    static int highest_bit(uint32_t x)
+    {
+        int bit = 0;
+        while (x >>= 1)
+            bit++;
+        return bit;
+    }
+
+    static uint32_t expand_bits(uint32_t v)
+    {
+        // Spreads the low 10 bits of v so there are two zero bits between each of them.
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    static std::vector<uint32_t> sort_by_morton_code(std::vector<build_prim> &prims, int threads)
+    {
+        // Quantizes each centroid to a 30-bit Morton code (10 bits per axis) and sorts the
+        // primitives by it with an LSD radix sort. Returns the sorted codes.
+        aabb centroid_bounds = aabb::empty;
+        for (const auto &p : prims)
+            centroid_bounds = aabb(centroid_bounds, aabb(p.centroid, p.centroid));
+
+        struct keyed
+        {
+            uint32_t code;
+            uint32_t prim;
+        };
+
+        const size_t n = prims.size();
+        std::vector<keyed> keys(n), scratch(n);
+
+        const size_t chunk = 16384;
+        work_stealing_scheduler scheduler(int((n + chunk - 1) / chunk), threads);
+        scheduler.run([&](int, int task)
+                      {
+            size_t begin = size_t(task) * chunk;
+            size_t end = std::min(n, begin + chunk);
+            for (size_t i = begin; i < end; i++)
+            {
+                uint32_t q[3];
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    const interval &extent = centroid_bounds.axis_interval(axis);
+                    double t = (prims[i].centroid[axis] - extent.min) / extent.size();
+                    q[axis] = uint32_t(std::clamp(t * 1024.0, 0.0, 1023.0));
+                }
+                keys[i] = {(expand_bits(q[0]) << 2) | (expand_bits(q[1]) << 1) | expand_bits(q[2]),
+                           uint32_t(i)};
+            } });
+
+        for (int shift = 0; shift < 32; shift += 8)
+        {
+            size_t counts[257] = {};
+            for (const auto &k : keys)
+                counts[((k.code >> shift) & 0xFF) + 1]++;
+            for (int digit = 0; digit < 256; digit++)
+                counts[digit + 1] += counts[digit];
+            for (const auto &k : keys)
+                scratch[counts[(k.code >> shift) & 0xFF]++] = k;
+            keys.swap(scratch);
+        }
+
+        std::vector<build_prim> sorted(n);
+        std::vector<uint32_t> codes(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            sorted[i] = prims[keys[i].prim];
+            codes[i] = keys[i].code;
+        }
+        prims.swap(sorted);
+        return codes;
+    }
+
+    static void set_bounds(linear_bvh_node &node, const aabb &box)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            node.bounds_min[axis] = round_down(box.axis_interval(axis).min);
+            node.bounds_max[axis] = round_up(box.axis_interval(axis).max);
+        }
+    }
+
+    static split find_split(const std::vector<build_prim> &prims, size_t start, size_t end,
+                            const aabb &centroid_bounds, double parent_area, const bvh_build_options &options,
+                            bool parallel)
+    {
+        // Bin the primitive centroids along each axis and sweep the bin boundaries, scoring each
+        // candidate split with the surface area heuristic. Axes along which all centroids coincide
+        // put everything in one bin and produce no candidates.
+        const int bins_per_axis = bin_count(options);
+
+        struct bin
+        {
+            aabb bounds = aabb::empty;
+            size_t count = 0;
+        };
+
+        auto best_on_axis = [&](int axis)
+        {
+            split best;
+            std::array<bin, max_bins> bins;
+            bin_mapper bin_of(centroid_bounds, axis, bins_per_axis);
+            for (size_t i = start; i < end; i++)
+            {
+                bin &b = bins[bin_of(prims[i].centroid)];
+                b.bounds = aabb(b.bounds, prims[i].bounds);
+                b.count++;
+            }
+
+            // Right-to-left sweep caches the area and count of everything past each boundary.
+            std::array<double, max_bins> right_area;
+            std::array<size_t, max_bins> right_count;
+            aabb acc = aabb::empty;
+            size_t count = 0;
+            for (int b = bins_per_axis - 1; b > 0; b--)
+            {
+                acc = aabb(acc, bins[b].bounds);
+                count += bins[b].count;
+                right_area[b] = count ? acc.surface_area() : 0;
+                right_count[b] = count;
+            }
+
+            acc = aabb::empty;
+            count = 0;
+            for (int b = 0; b < bins_per_axis - 1; b++)
+            {
+                acc = aabb(acc, bins[b].bounds);
+                count += bins[b].count;
+                if (count == 0 || right_count[b + 1] == 0)
+                    continue;
+
+                double c = options.traversal_cost +
+                           options.intersection_cost *
+                               (acc.surface_area() * double(count) + right_area[b + 1] * double(right_count[b + 1])) /
+                               parent_area;
+                if (c < best.cost)
+                {
+                    best.axis = axis;
+                    best.bin = b;
+                    best.cost = c;
+                }
+            }
+            return best;
+        };
+
+        // The three axes are independent; for large spans near the root, bin them concurrently.
+        split candidates[3];
+        if (parallel)
+        {
+            work_stealing_scheduler scheduler(3, 3);
+            scheduler.run([&](int worker, int axis)
+            {
+                (void)worker;
+                candidates[axis] = best_on_axis(axis);
+            });
+        }
+        else
+        {
+            for (int axis = 0; axis < 3; axis++)
+                candidates[axis] = best_on_axis(axis);
+        }
+
+        split best;
+        for (const split &candidate : candidates)
+        {
+            if (candidate.cost < best.cost)
+                best = candidate;
+        }
+        return best;
+    }
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include "sphere.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "scene.h"
 #include "raytracer.h"
 #include "camera.h"
 #include "material.h"
@@ -9,10 +10,11 @@
 #include "quad.h"
 #include "obj.h"
 #include "constant_medium.h"
+#include "instance.h"
 
 void depth_of_field_demo()
 {
-    hittable_list world;
+    scene world;
 
     auto ground = make_shared<lambertian>(color(0.2, 1.0, 0.0));
     auto center = make_shared<lambertian>(color(0.9, 0.2, 0.2));
@@ -24,7 +26,7 @@ void depth_of_field_demo()
     world.add(make_shared<sphere>(point3(-1.0, 0.0, -0.8), 0.5, metal_mat)); // closer
     world.add(make_shared<sphere>(point3(1.0, 0.0, -1.8), 0.5, metal_mat));  // farther
 
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = scene(make_shared<bvh_node>(world));
 
     camera cam;
 
@@ -32,6 +34,7 @@ void depth_of_field_demo()
     cam.image_width = 800;
     cam.samples_per_pixel = 500;
     cam.max_depth = 50;
+    cam.adaptive_sampling = true; // Flat sky and ground converge long before the blurred edges
 
     cam.vfov = 25;
     cam.camera_center = point3(-2, 2, 1);
@@ -46,7 +49,7 @@ void depth_of_field_demo()
 
 void house_demo()
 {
-    hittable_list world;
+    scene world;
 
     auto house_texture = make_shared<image_texture>("house_rgb.jpg");
     auto house_alpha = make_shared<image_texture>("house_alpha.jpg");
@@ -80,7 +83,7 @@ void house_demo()
 
 void bouncing_spheres()
 {
-    hittable_list world;
+    scene world;
 
     auto checker = make_shared<solid_color>(color(1.0, 0.0, 0.0));
     world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
@@ -122,7 +125,7 @@ void bouncing_spheres()
         }
     }
 
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = scene(make_shared<bvh_node>(world));
 
     camera cam;
 
@@ -145,7 +148,7 @@ void bouncing_spheres()
 
 void material_showcase()
 {
-    hittable_list world;
+    scene world;
 
     // Ground
     auto ground_mat = make_shared<lambertian>(color(0.8, 0.8, 0.8));
@@ -175,7 +178,7 @@ void material_showcase()
     world.add(make_shared<quad>(point3(-2, 2.5, -1.5), vec3(4, 0, 0), vec3(0, 0, 3), light_mat));
 
     // Optional BVH for consistency
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = scene(make_shared<bvh_node>(world));
 
     camera cam;
     cam.aspect_ratio = 1.0;
@@ -197,7 +200,7 @@ void material_showcase()
 
 void perlin_spheres()
 {
-    hittable_list world;
+    scene world;
 
     auto pertext = make_shared<noise_texture>(4);
     world.add(make_shared<sphere>(point3(0, 0, -1), 0.5, make_shared<lambertian>(pertext)));
@@ -223,7 +226,7 @@ void perlin_spheres()
 
 void final_render()
 {
-    hittable_list world;
+    scene world;
 
     //--- Tree Model ---
     auto leafs_color = make_shared<image_texture>("leafs.jpg");
@@ -364,36 +367,41 @@ void final_render()
     auto wrap_white = make_shared<lambertian>(color(0.95, 0.95, 0.95));
     auto wrap_gold = make_shared<metal>(color(0.90, 0.75, 0.20), 0.05);
 
-    auto pick_wrap = [&]() -> shared_ptr<material>
+    // Every present is an instance of one shared unit box per wrap. The box is built once as a
+    // bottom-level BVH, and each present only adds a transform.
+    auto unit_present = [&](shared_ptr<material> wrap) -> shared_ptr<hittable>
+    {
+        // Unit box centered on the origin in x/z, sitting on y=0
+        return make_shared<bvh_node>(*box(point3(-0.5, 0.0, -0.5), point3(0.5, 1.0, 0.5), wrap));
+    };
+
+    std::vector<shared_ptr<hittable>> present_boxes = {
+        unit_present(wrap_red), unit_present(wrap_green), unit_present(wrap_blue),
+        unit_present(wrap_white), unit_present(wrap_gold)};
+
+    auto pick_wrap = [&]() -> shared_ptr<hittable>
     {
         double t = random_double();
         if (t < 0.20)
-            return wrap_red;
+            return present_boxes[0];
         if (t < 0.40)
-            return wrap_green;
+            return present_boxes[1];
         if (t < 0.60)
-            return wrap_blue;
+            return present_boxes[2];
         if (t < 0.80)
-            return wrap_white;
-        return wrap_gold;
+            return present_boxes[3];
+        return present_boxes[4];
     };
 
-    // Helper: make one present centered at 'c' with size 's' and yaw rotation.
+    // Helper: place one present centered at 'c' with size 's' and yaw rotation.
     auto add_present = [&](const point3 &c, const vec3 &s, double yaw_deg)
     {
-        // Build box in local space around origin, sitting on y=0
-        point3 a(-0.5 * s.x, 0.0, -0.5 * s.z);
-        point3 b(0.5 * s.x, s.y, 0.5 * s.z);
+        // Scale the unit box, rotate around Y, then translate into place
+        auto placement = affine_transform::translation(c) *
+                         affine_transform::rotation_y(yaw_deg) *
+                         affine_transform::scaling(s);
 
-        auto gift = box(a, b, pick_wrap());
-
-        // Rotate around Y, then translate into place
-        shared_ptr<hittable> placed =
-            make_shared<translate>(
-                make_shared<rotate_y>(gift, yaw_deg),
-                vec3(c.x, c.y, c.z));
-
-        world.add(placed);
+        world.add(make_shared<instance>(pick_wrap(), placement));
     };
 
     const int present_count = 140;
@@ -422,6 +430,9 @@ void final_render()
         add_present(c, s, yaw);
     }
 
+    // Top-level BVH over the meshes, spheres and present instances
+    world = scene(make_shared<bvh_node>(world));
+
     camera cam;
 
     cam.aspect_ratio = 16.0 / 9.0;
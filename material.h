@@ -5,29 +5,128 @@
 #include "material.h"
 #include "texture.h"
 
+#include <unordered_map>
+#include <vector>
+
+// Kinds of bounce, which can have separate depth limits.
+enum class scatter_lobe
+{
+    diffuse,
+    specular,
+    transmission
+};
+
+// A direction drawn by material::sample().
+struct scatter_sample
+{
+    vec3 direction;           // Unit length, pointing away from the surface
+    color weight;             // eval(direction) / pdf, or the attenuation of a specular bounce
+    real pdf = 0;             // Solid angle density of direction; 0 for specular bounces
+    bool is_specular = false; // Direction was not drawn from a density that pdf() can evaluate
+    scatter_lobe lobe = scatter_lobe::diffuse;
+};
+
 class material
 {
 public:
     virtual ~material() = default;
 
-    virtual color emitted(double u, double v, const point3 &p) const
+    virtual color emitted(real u, real v, const point3 &p) const
+    {
+        return color(0, 0, 0);
+    }
+
+    // Draws the direction of the next path segment for a ray r_in arriving at rec. Returns false
+    // if the path ends here.
+    virtual bool sample(const ray &r_in, const hit_record &rec, scatter_sample &s) const
     {
+        (void)r_in;
+        (void)rec;
+        (void)s;
+        return false;
+    }
+
+    // Scattering function times the cosine at the surface, for light arriving from direction wi
+    // (unit length, pointing away from the surface) and leaving along -r_in.direction. Only
+    // called when is_specular() is false.
+    virtual color eval(const ray &r_in, const hit_record &rec, const vec3 &wi) const
+    {
+        (void)r_in;
+        (void)rec;
+        (void)wi;
         return color(0, 0, 0);
     }
 
-    virtual bool scatter(
-        const ray &r_in,
-        const hit_record &rec,
-        color &attenuation,
-        ray &scattered) const = 0;
+    // Density with which sample() draws wi. Only called when is_specular() is false.
+    virtual real pdf(const ray &r_in, const hit_record &rec, const vec3 &wi) const
+    {
+        (void)r_in;
+        (void)rec;
+        (void)wi;
+        return 0;
+    }
+
+    // True if sample() draws directions eval() and pdf() cannot describe, so lights are not
+    // sampled directly from this material.
+    virtual bool is_specular() const { return true; }
+
+    virtual bool is_emissive() const { return false; }
 
-    virtual bool accept_hit(double u, double v, const point3 &p) const
+    // True for phase functions, which scatter the same in every direction around a point that
+    // has no surface normal.
+    virtual bool is_volumetric() const { return false; }
+
+    virtual bool accept_hit(real u, real v, const point3 &p) const
     {
         (void)u;
         (void)v;
         (void)p;
         return true; // opaque by default
     }
+
+    // Whether accept_hit() passes all, none or only part of a triangle with texture coordinates
+    // (u[k], v[k]) at its corners, so meshes can skip the test or the triangle. Materials that
+    // override accept_hit() must override this too.
+    virtual alpha_coverage triangle_coverage(const real u[3], const real v[3]) const
+    {
+        (void)u;
+        (void)v;
+        return alpha_coverage::opaque;
+    }
+};
+
+// The materials of one scene, by index. Hit records refer to materials by index, so recording a
+// hit copies an integer instead of touching a shared_ptr's reference count. A scene owns its
+// table and fills it in before each render (see scene::register_materials).
+class material_table
+{
+public:
+    // Registers mat and returns its id. Adding the same material again returns the same id.
+    material_id add(shared_ptr<material> mat)
+    {
+        auto found = ids.find(mat.get());
+        if (found != ids.end())
+            return found->second;
+
+        material_id id = material_id(materials.size());
+        materials.push_back(mat);
+        ids.emplace(mat.get(), id);
+        return id;
+    }
+
+    const material &operator[](material_id id) const { return *materials[id]; }
+
+    size_t size() const { return materials.size(); }
+
+    void clear()
+    {
+        materials.clear();
+        ids.clear();
+    }
+
+private:
+    std::vector<shared_ptr<material>> materials;
+    std::unordered_map<const material *, material_id> ids;
 };
 
 class lambertian : public material
@@ -43,18 +142,35 @@ public:
         tex = tex_input;
     }
 
-    bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered)
-        const override
+    bool sample(const ray &r_in, const hit_record &rec, scatter_sample &s) const override
     {
+        // Cosine-weighted hemisphere, so the weight is just the albedo.
         (void)r_in;
         auto scatter_direction = rec.normal + random_unit_vector();
         if (scatter_direction.near_zero()) // Catch degenerate scatter direction
             scatter_direction = rec.normal;
-        scattered = ray(rec.p, scatter_direction, r_in.time);
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+        s.direction = unit_vector(scatter_direction);
+        s.weight = tex->filtered_value(rec.u, rec.v, rec.p, rec.uv_footprint);
+        s.pdf = std::fmax(real(0), dot(rec.normal, s.direction)) / pi;
+        s.is_specular = false;
         return true;
     }
 
+    color eval(const ray &r_in, const hit_record &rec, const vec3 &wi) const override
+    {
+        (void)r_in;
+        color albedo = tex->filtered_value(rec.u, rec.v, rec.p, rec.uv_footprint);
+        return albedo * (std::fmax(real(0), dot(rec.normal, wi)) / pi);
+    }
+
+    real pdf(const ray &r_in, const hit_record &rec, const vec3 &wi) const override
+    {
+        (void)r_in;
+        return std::fmax(real(0), dot(rec.normal, wi)) / pi;
+    }
+
+    bool is_specular() const override { return false; }
+
 private:
     // color albedo;
     shared_ptr<texture> tex;
@@ -64,50 +180,80 @@ class alpha_lambertian : public material
 {
 public:
     alpha_lambertian(shared_ptr<texture> color_tex, shared_ptr<texture> opacity_tex)
+        : alpha_lambertian(color_tex, opacity_tex, 0.5)
     {
-        tex = color_tex;
-        alpha = opacity_tex;
-        alpha_cutoff = 0.5;
     }
 
-    alpha_lambertian(shared_ptr<texture> color_tex, shared_ptr<texture> opacity_tex, double cutoff)
+    alpha_lambertian(shared_ptr<texture> color_tex, shared_ptr<texture> opacity_tex, real cutoff)
     {
         tex = color_tex;
         alpha = opacity_tex;
         alpha_cutoff = cutoff;
+
+        // Image opacity is thresholded once into a bit per texel.
+        auto image = std::dynamic_pointer_cast<image_texture>(alpha);
+        if (image && image->width() > 0)
+            mask = make_shared<coverage_mask>(image, alpha_cutoff);
+    }
+
+    bool accept_hit(real u, real v, const point3 &p) const override
+    {
+        if (mask)
+            return mask->covered(u, v);
+        return passes_cutoff(alpha->value(u, v, p), alpha_cutoff);
     }
 
-    bool accept_hit(double u, double v, const point3 &p) const override
+    alpha_coverage triangle_coverage(const real u[3], const real v[3]) const override
     {
-        // white is opaque while black is tranparent
-        color a = alpha->value(u, v, p);
-        double av = (a.x + a.y + a.z) / 3.0;
-        return av >= alpha_cutoff;
+        return mask ? mask->classify(u, v) : alpha_coverage::mixed;
     }
 
-    bool scatter(const ray &r_in, const hit_record &rec,
-                 color &attenuation, ray &scattered) const override
+    bool sample(const ray &r_in, const hit_record &rec, scatter_sample &s) const override
     {
         (void)r_in;
         auto scatter_direction = rec.normal + random_unit_vector();
         if (scatter_direction.near_zero())
             scatter_direction = rec.normal;
 
-        scattered = ray(rec.p, scatter_direction, r_in.time);
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+        s.direction = unit_vector(scatter_direction);
+        s.weight = albedo(rec);
+        s.pdf = std::fmax(real(0), dot(rec.normal, s.direction)) / pi;
+        s.is_specular = false;
         return true;
     }
 
+    color eval(const ray &r_in, const hit_record &rec, const vec3 &wi) const override
+    {
+        (void)r_in;
+        return albedo(rec) * (std::fmax(real(0), dot(rec.normal, wi)) / pi);
+    }
+
+    real pdf(const ray &r_in, const hit_record &rec, const vec3 &wi) const override
+    {
+        (void)r_in;
+        return std::fmax(real(0), dot(rec.normal, wi)) / pi;
+    }
+
+    bool is_specular() const override { return false; }
+
 private:
     shared_ptr<texture> tex;
     shared_ptr<texture> alpha;
-    double alpha_cutoff;
+    real alpha_cutoff;
+    shared_ptr<coverage_mask> mask; // Null unless alpha is an image
+
+    color albedo(const hit_record &rec) const
+    {
+        // Texels under the cutout hold colours that are never seen, which coarser mip levels
+        // would blend into the visible ones, so only the full resolution level is read.
+        return tex->filtered_value(rec.u, rec.v, rec.p, 0);
+    }
 };
 
 class metal : public material
 {
 public:
-    metal(const color &albedo_input, double fuzz_input)
+    metal(const color &albedo_input, real fuzz_input)
     {
         albedo = albedo_input;
         if (fuzz_input < 1)
@@ -116,57 +262,69 @@ public:
             fuzz = 1;
     }
 
-    bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered)
-        const override
+    bool sample(const ray &r_in, const hit_record &rec, scatter_sample &s) const override
     {
+        // The fuzzed lobe has no closed-form density, so it is treated as specular.
         vec3 reflected = reflect(r_in.direction, rec.normal);
         reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-        scattered = ray(rec.p, reflected, r_in.time);
-        attenuation = albedo;
-        return (dot(scattered.direction, rec.normal) > 0);
+        if (reflected.near_zero())
+            return false;
+        s.direction = unit_vector(reflected);
+        s.weight = albedo;
+        s.pdf = 0;
+        s.is_specular = true;
+        s.lobe = scatter_lobe::specular;
+        return (dot(s.direction, rec.normal) > 0);
     }
 
 private:
     color albedo;
-    double fuzz;
+    real fuzz;
 };
 
 class dielectric : public material
 {
 public:
-    dielectric(double refraction_index_input)
+    dielectric(real refraction_index_input)
     {
         refraction_index = refraction_index_input;
     }
 
-    bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered)
-        const override
+    bool sample(const ray &r_in, const hit_record &rec, scatter_sample &s) const override
     {
-        attenuation = color(1.0, 1.0, 1.0);
-        double ri = rec.front_face ? (1.0 / refraction_index) : refraction_index;
+        real ri = rec.front_face ? (1.0 / refraction_index) : refraction_index;
 
         vec3 unit_direction = unit_vector(r_in.direction);
-        double cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
-        double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
+        real cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
+        real sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
 
         bool cannot_refract = ri * sin_theta > 1.0;
         vec3 direction;
 
         if (cannot_refract || reflectance(cos_theta, ri) > random_double())
+        {
             direction = reflect(unit_direction, rec.normal);
+            s.lobe = scatter_lobe::specular;
+        }
         else
+        {
             direction = refract(unit_direction, rec.normal, ri);
+            s.lobe = scatter_lobe::transmission;
+        }
 
-        scattered = ray(rec.p, direction, r_in.time);
+        s.direction = unit_vector(direction);
+        s.weight = color(1.0, 1.0, 1.0);
+        s.pdf = 0;
+        s.is_specular = true;
         return true;
     }
 
 private:
     // Refractive index in vacuum or air, or the ratio of the material's refractive index over
     // the refractive index of the enclosing media
-    double refraction_index;
+    real refraction_index;
 
-    static double reflectance(double cosine, double refraction_index)
+    static real reflectance(real cosine, real refraction_index)
     {
         // Use Schlick's approximation for reflectance.
         auto r0 = (1 - refraction_index) / (1 + refraction_index);
@@ -188,22 +346,12 @@ public:
         tex = make_shared<solid_color>(emit);
     }
 
-    color emitted(double u, double v, const point3 &p) const override
+    color emitted(real u, real v, const point3 &p) const override
     {
         return tex->value(u, v, p);
     }
 
-    bool scatter(const ray &r_in,
-                 const hit_record &rec,
-                 color &attenuation,
-                 ray &scattered) const override
-    {
-        (void)r_in;
-        (void)rec;
-        (void)attenuation;
-        (void)scattered;
-        return false;
-    }
+    bool is_emissive() const override { return true; }
 
 private:
     shared_ptr<texture> tex;
@@ -222,14 +370,35 @@ public:
         tex = tex_input;
     }
 
-    bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered)
-        const override
+    bool sample(const ray &r_in, const hit_record &rec, scatter_sample &s) const override
     {
-        scattered = ray(rec.p, random_unit_vector(), r_in.time);
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+        (void)r_in;
+        s.direction = random_unit_vector();
+        s.weight = tex->value(rec.u, rec.v, rec.p);
+        s.pdf = 1 / (4 * pi);
+        s.is_specular = false;
         return true;
     }
 
+    color eval(const ray &r_in, const hit_record &rec, const vec3 &wi) const override
+    {
+        // Uniform phase function; there is no surface, so no cosine.
+        (void)r_in;
+        (void)wi;
+        return tex->value(rec.u, rec.v, rec.p) / (4 * pi);
+    }
+
+    real pdf(const ray &r_in, const hit_record &rec, const vec3 &wi) const override
+    {
+        (void)r_in;
+        (void)rec;
+        (void)wi;
+        return 1 / (4 * pi);
+    }
+
+    bool is_specular() const override { return false; }
+    bool is_volumetric() const override { return true; }
+
 private:
     shared_ptr<texture> tex;
 };
@@ -0,0 +1,468 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "raytracer.h"
+#include "hittable.h"
+#include "material.h"
+#include "bvh.h"
+#include "triangle_packet.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Single-precision vertex attributes, as stored in mesh buffers.
+struct vec3f
+{
+    float x = 0, y = 0, z = 0;
+
+    vec3f() {}
+    vec3f(float x1, float y1, float z1) : x(x1), y(y1), z(z1) {}
+    explicit vec3f(const vec3 &v) : x(float(v.x)), y(float(v.y)), z(float(v.z)) {}
+
+    vec3 to_vec3() const { return vec3(x, y, z); }
+};
+
+struct vec2f
+{
+    float x = 0, y = 0;
+
+    vec2f() {}
+    vec2f(float x1, float y1) : x(x1), y(y1) {}
+};
+
+// Indexed triangle mesh. Vertex attributes live in shared position/normal/UV buffers and each
+// triangle is three 32-bit indices into them, so vertices shared between triangles are stored
+// once. The BVH leaves refer to triangle numbers directly: the index buffer is reordered into
+// leaf order when the mesh is built.
+//
+// For intersection, each leaf's triangles are also gathered into 4 or 8 wide packets tested with
+// a SIMD watertight kernel. hit() only records the closest triangle and its barycentrics;
+// normals, UVs and the hit point are interpolated by finalize(), once the scene's closest hit
+// is known.
+class triangle_mesh : public hittable
+{
+public:
+    triangle_mesh() {}
+
+    // normals and uvs may be empty, or hold one entry per position. A zero normal makes a vertex
+    // fall back to the geometric normal.
+    triangle_mesh(std::vector<vec3f> positions_input, std::vector<vec3f> normals_input,
+                  std::vector<vec2f> uvs_input, std::vector<uint32_t> indices_input,
+                  shared_ptr<material> mat_input, const bvh_build_options &options = bvh_build_options())
+    {
+        positions = std::move(positions_input);
+        normals = std::move(normals_input);
+        uvs = std::move(uvs_input);
+        indices = std::move(indices_input);
+        mat = mat_input;
+        build(options);
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        closest_hit closest;
+        bool found = packet_width == 8 ? intersect_packets(packets8, r, ray_t, closest)
+                                       : intersect_packets(packets4, r, ray_t, closest);
+        if (!found)
+            return false;
+
+        record_hit(closest, rec);
+        return true;
+    }
+
+    unsigned hit_packet(ray_packet &packet, unsigned active, hit_record *recs) const override
+    {
+        if (!packet.coherent(active))
+            return hittable::hit_packet(packet, active, recs);
+
+        closest_hit closest[ray_packet_size];
+        unsigned found = packet_width == 8 ? intersect_packets(packets8, packet, active, closest)
+                                           : intersect_packets(packets4, packet, active, closest);
+        for (unsigned rest = found; rest; rest &= rest - 1)
+            record_hit(closest[lowest_bit(rest)], recs[lowest_bit(rest)]);
+        return found;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return packet_width == 8 ? occluded_packets(packets8, r, ray_t) : occluded_packets(packets4, r, ray_t);
+    }
+
+    unsigned occluded_packet(ray_packet &packet, unsigned active) const override
+    {
+        if (!packet.coherent(active))
+            return hittable::occluded_packet(packet, active);
+        return packet_width == 8 ? occluded_packets(packets8, packet, active)
+                                 : occluded_packets(packets4, packet, active);
+    }
+
+    void finalize(const ray &r, hit_record &rec) const override
+    {
+        const uint32_t i0 = indices[3 * size_t(rec.prim_index)];
+        const uint32_t i1 = indices[3 * size_t(rec.prim_index) + 1];
+        const uint32_t i2 = indices[3 * size_t(rec.prim_index) + 2];
+        const real b0 = 1 - rec.b1 - rec.b2;
+
+        point3 v0 = positions[i0].to_vec3();
+        point3 v1 = positions[i1].to_vec3();
+        point3 v2 = positions[i2].to_vec3();
+
+        // The interpolated point carries much less rounding error than r.at(t), so spawned rays
+        // only need a small offset. The packet kernels intersect in float, though, so the offset
+        // is sized in float: a double sized one leaves the next ray's origin within the float
+        // kernel's error of this triangle, and it hits it again.
+        rec.p = b0 * v0 + rec.b1 * v1 + rec.b2 * v2;
+        rec.p_error = rounding_gamma<float>(7) * aabb(aabb(v0, v1), aabb(v2, v2)).max_abs_coordinate();
+        texture_coordinates(rec.prim_index, rec.b1, rec.b2, rec.u, rec.v);
+
+        // Normal interpolation
+        vec3 interp_n;
+        if (!normals.empty())
+            interp_n = b0 * normals[i0].to_vec3() + rec.b1 * normals[i1].to_vec3() + rec.b2 * normals[i2].to_vec3();
+        if (interp_n.length_squared() < 1e-8)
+            interp_n = unit_vector(cross(v1 - v0, v2 - v0));
+        else
+            interp_n = unit_vector(interp_n);
+
+        rec.set_face_normal(r, interp_n);
+        vec3 edge_cross = cross(v1 - v0, v2 - v0);
+        rec.geometric_normal = unit_vector(edge_cross);
+
+        // Ratio of the triangle's area in texture space to its area in world space.
+        rec.uv_scale = 0;
+        if (!uvs.empty())
+        {
+            const vec2f &t0 = uvs[i0], &t1 = uvs[i1], &t2 = uvs[i2];
+            real uv_area = std::fabs(real(t1.x - t0.x) * (t2.y - t0.y) - real(t2.x - t0.x) * (t1.y - t0.y));
+            real area = edge_cross.length();
+            if (area > 0)
+                rec.uv_scale = std::sqrt(uv_area / area);
+        }
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    void register_materials(material_table &table) override { mat_id = table.add(mat); }
+
+    size_t triangle_count() const { return indices.size() / 3; }
+    size_t vertex_count() const { return positions.size(); }
+
+    // Bytes used by the vertex, index and BVH buffers.
+    size_t memory_bytes() const
+    {
+        return positions.capacity() * sizeof(vec3f) + normals.capacity() * sizeof(vec3f) +
+               uvs.capacity() * sizeof(vec2f) + indices.capacity() * sizeof(uint32_t) + accel.memory_bytes() +
+               packets4.capacity() * sizeof(triangle_packet<4>) + packets8.capacity() * sizeof(triangle_packet<8>) +
+               leaf_packets.capacity() * sizeof(uint32_t) + cutout.capacity();
+    }
+
+    std::string build_report() const { return accel.build_report(); }
+
+protected:
+    std::vector<vec3f> positions;
+    std::vector<vec3f> normals;
+    std::vector<vec2f> uvs;
+    std::vector<uint32_t> indices; // Three per triangle
+    shared_ptr<material> mat;
+    material_id mat_id = 0; // mat's index in the scene's material table
+
+    void build(const bvh_build_options &options)
+    {
+        std::vector<uint8_t> partial = classify_coverage();
+
+        // Build the BVH over the triangle bounds, then reorder the index buffer so triangle
+        // number i is leaf slot i.
+        const size_t count = triangle_count();
+        std::vector<aabb> boxes(count);
+        bbox = aabb::empty;
+        for (size_t tri = 0; tri < count; tri++)
+        {
+            point3 a = positions[indices[3 * tri]].to_vec3();
+            point3 b = positions[indices[3 * tri + 1]].to_vec3();
+            point3 c = positions[indices[3 * tri + 2]].to_vec3();
+            boxes[tri] = aabb(aabb(a, b), aabb(c, c));
+            bbox = aabb(bbox, boxes[tri]);
+        }
+
+        std::vector<uint32_t> order;
+        accel.build(boxes, options, order);
+
+        std::vector<uint32_t> sorted(indices.size());
+        for (size_t slot = 0; slot < order.size(); slot++)
+            for (int k = 0; k < 3; k++)
+                sorted[3 * slot + k] = indices[3 * size_t(order[slot]) + k];
+        indices.swap(sorted);
+        indices.shrink_to_fit();
+
+        cutout.clear();
+        if (!partial.empty())
+        {
+            cutout.resize(order.size());
+            for (size_t slot = 0; slot < order.size(); slot++)
+                cutout[slot] = partial[order[slot]];
+        }
+
+        // Eight wide packets only pay off when leaves can hold more than four triangles.
+        packet_width = (cpu_has_avx2() && options.max_leaf_size > 4) ? 8 : 4;
+        packets4.clear();
+        packets8.clear();
+        if (packet_width == 8)
+            build_packets(packets8);
+        else
+            build_packets(packets4);
+    }
+
+private:
+    bvh_accel accel;
+    aabb bbox;
+
+    // Packets of the BVH leaves, and for each leaf's first triangle slot the index of its first
+    // packet. A leaf of n triangles owns ceil(n / W) consecutive packets.
+    int packet_width = 4;
+    std::vector<triangle_packet<4>> packets4;
+    std::vector<triangle_packet<8>> packets8;
+    std::vector<uint32_t> leaf_packets;
+
+    // Per leaf slot, whether the material's cutout hides only part of the triangle, so hits on it
+    // need accept_hit(). Empty when no triangle does.
+    std::vector<uint8_t> cutout;
+
+    struct closest_hit
+    {
+        uint32_t tri = 0;
+        real t = 0;
+        real b1 = 0, b2 = 0; // Barycentric weights of the second and third vertex
+    };
+
+    template <int W>
+    using packet_test_fn = unsigned (*)(const triangle_packet<W> &, const watertight_ray &, unsigned, float, float,
+                                        triangle_kernels::packet_hits &);
+
+    template <int W>
+    static packet_test_fn<W> select_packet_test()
+    {
+#if RT_SIMD_X86
+        if constexpr (W == 8)
+        {
+            if (cpu_has_avx2())
+                return triangle_kernels::intersect_avx2;
+        }
+        return triangle_kernels::intersect_sse_lanes<W>;
+#else
+        return triangle_kernels::intersect_scalar<W>;
+#endif
+    }
+
+    template <int W>
+    void build_packets(std::vector<triangle_packet<W>> &packets)
+    {
+        leaf_packets.assign(triangle_count(), 0);
+        accel.for_each_leaf([&](uint32_t first, uint32_t count)
+        {
+            leaf_packets[first] = uint32_t(packets.size());
+            for (uint32_t base = 0; base < count; base += W)
+            {
+                triangle_packet<W> p = {};
+                for (uint32_t lane = 0; lane < uint32_t(W) && base + lane < count; lane++)
+                {
+                    const size_t tri = size_t(first) + base + lane;
+                    const vec3f &a = positions[indices[3 * tri]];
+                    const vec3f &b = positions[indices[3 * tri + 1]];
+                    const vec3f &c = positions[indices[3 * tri + 2]];
+                    const float *corners[3] = {&a.x, &b.x, &c.x};
+                    for (int axis = 0; axis < 3; axis++)
+                    {
+                        p.v0[axis][lane] = corners[0][axis];
+                        p.v1[axis][lane] = corners[1][axis];
+                        p.v2[axis][lane] = corners[2][axis];
+                    }
+                }
+                packets.push_back(p);
+            }
+        });
+        packets.shrink_to_fit();
+    }
+
+    void record_hit(const closest_hit &closest, hit_record &rec) const
+    {
+        rec.t = closest.t;
+        rec.mat = mat_id;
+        rec.object = this;
+        rec.instance_depth = 0;
+        rec.prim_index = closest.tri;
+        rec.b1 = closest.b1;
+        rec.b2 = closest.b2;
+    }
+
+    template <int W>
+    bool intersect_packets(const std::vector<triangle_packet<W>> &packets, const ray &r, interval ray_t,
+                           closest_hit &closest) const
+    {
+        const watertight_ray wr(r);
+        auto intersect_leaf = [&](uint32_t first, uint32_t count, interval &t)
+        { return intersect_leaf_packets(packets, r, wr, first, count, t, closest); };
+        return accel.traverse(r, ray_t, intersect_leaf);
+    }
+
+    // The same for the active lanes of a ray packet, sharing the BVH node tests between them.
+    template <int W>
+    unsigned intersect_packets(const std::vector<triangle_packet<W>> &packets, ray_packet &packet, unsigned active,
+                               closest_hit *closest) const
+    {
+        watertight_ray wr[ray_packet_size];
+        for (unsigned rest = active; rest; rest &= rest - 1)
+            wr[lowest_bit(rest)] = watertight_ray(packet.rays[lowest_bit(rest)]);
+
+        auto intersect_leaf = [&](int lane, uint32_t first, uint32_t count, interval &t)
+        { return intersect_leaf_packets(packets, packet.rays[lane], wr[lane], first, count, t, closest[lane]); };
+        return accel.traverse_packet(packet, active, intersect_leaf);
+    }
+
+    template <int W>
+    bool occluded_packets(const std::vector<triangle_packet<W>> &packets, const ray &r, interval ray_t) const
+    {
+        const watertight_ray wr(r);
+        auto occluded_leaf = [&](uint32_t first, uint32_t count, interval &t)
+        { return occluded_leaf_packets(packets, r, wr, first, count, t); };
+        return accel.traverse(r, ray_t, occluded_leaf);
+    }
+
+    template <int W>
+    unsigned occluded_packets(const std::vector<triangle_packet<W>> &packets, ray_packet &packet,
+                              unsigned active) const
+    {
+        watertight_ray wr[ray_packet_size];
+        for (unsigned rest = active; rest; rest &= rest - 1)
+            wr[lowest_bit(rest)] = watertight_ray(packet.rays[lowest_bit(rest)]);
+
+        auto occluded_leaf = [&](int lane, uint32_t first, uint32_t count, interval &t)
+        { return occluded_leaf_packets(packets, packet.rays[lane], wr[lane], first, count, t); };
+        return accel.traverse_packet(packet, active, occluded_leaf);
+    }
+
+    // Any-hit version of intersect_leaf_packets(): stops at the first triangle that passes the
+    // cutout test and empties t.
+    template <int W>
+    bool occluded_leaf_packets(const std::vector<triangle_packet<W>> &packets, const ray &r,
+                               const watertight_ray &wr, uint32_t first, uint32_t count, interval &t) const
+    {
+        static const packet_test_fn<W> packet_test = select_packet_test<W>();
+        uint32_t packet = leaf_packets[first];
+        for (uint32_t base = 0; base < count; base += W, packet++)
+        {
+            const uint32_t lanes = std::min<uint32_t>(W, count - base);
+            triangle_kernels::packet_hits hits;
+            unsigned mask = packet_test(packets[packet], wr, (1u << lanes) - 1, float(t.min), float(t.max), hits);
+            for (; mask; mask &= mask - 1)
+            {
+                const int lane = lowest_bit(mask);
+                if (accept_hit(first + base + uint32_t(lane), r, hits.t[lane], hits.b1[lane], hits.b2[lane]))
+                {
+                    t = interval::empty;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    template <int W>
+    bool intersect_leaf_packets(const std::vector<triangle_packet<W>> &packets, const ray &r,
+                                const watertight_ray &wr, uint32_t first, uint32_t count, interval &t,
+                                closest_hit &closest) const
+    {
+        static const packet_test_fn<W> packet_test = select_packet_test<W>();
+        bool hit_anything = false;
+        uint32_t packet = leaf_packets[first];
+        for (uint32_t base = 0; base < count; base += W, packet++)
+        {
+            const uint32_t lanes = std::min<uint32_t>(W, count - base);
+            triangle_kernels::packet_hits hits;
+            unsigned mask = packet_test(packets[packet], wr, (1u << lanes) - 1, float(t.min), float(t.max), hits);
+
+            // Take hit lanes nearest first, until one passes the material's cutout test.
+            while (mask)
+            {
+                int best = lowest_bit(mask);
+                for (unsigned rest = mask & (mask - 1); rest; rest &= rest - 1)
+                    if (hits.t[lowest_bit(rest)] < hits.t[best])
+                        best = lowest_bit(rest);
+                mask &= ~(1u << best);
+
+                const uint32_t tri = first + base + uint32_t(best);
+                if (!accept_hit(tri, r, hits.t[best], hits.b1[best], hits.b2[best]))
+                    continue;
+
+                closest.tri = tri;
+                closest.t = hits.t[best];
+                closest.b1 = hits.b1[best];
+                closest.b2 = hits.b2[best];
+                t.max = hits.t[best];
+                hit_anything = true;
+                break;
+            }
+        }
+        return hit_anything;
+    }
+
+    // Asks the material for the coverage of every triangle. Triangles its cutout hides
+    // completely are removed, so they never reach the BVH. Returns whether each remaining
+    // triangle is only partly covered, or nothing if none is.
+    std::vector<uint8_t> classify_coverage()
+    {
+        const material &m = *mat;
+        std::vector<uint8_t> partial;
+        bool any_partial = false;
+        size_t kept = 0;
+        for (size_t tri = 0; tri < triangle_count(); tri++)
+        {
+            real u[3] = {0, 0, 0}, v[3] = {0, 0, 0};
+            if (!uvs.empty())
+                for (int k = 0; k < 3; k++)
+                {
+                    u[k] = uvs[indices[3 * tri + k]].x;
+                    v[k] = uvs[indices[3 * tri + k]].y;
+                }
+
+            alpha_coverage coverage = m.triangle_coverage(u, v);
+            if (coverage == alpha_coverage::transparent)
+                continue;
+            for (int k = 0; k < 3; k++)
+                indices[3 * kept + k] = indices[3 * tri + k];
+            partial.push_back(coverage == alpha_coverage::mixed);
+            any_partial |= coverage == alpha_coverage::mixed;
+            kept++;
+        }
+        indices.resize(3 * kept);
+        if (!any_partial)
+            partial.clear();
+        return partial;
+    }
+
+    bool accept_hit(uint32_t tri, const ray &r, real t, real b1, real b2) const
+    {
+        if (cutout.empty() || !cutout[tri])
+            return true;
+
+        // If material is transparent here
+        real tex_u, tex_v;
+        texture_coordinates(tri, b1, b2, tex_u, tex_v);
+        return mat->accept_hit(tex_u, tex_v, r.at(t));
+    }
+
+    void texture_coordinates(uint32_t tri, real b1, real b2, real &tex_u, real &tex_v) const
+    {
+        tex_u = tex_v = 0;
+        if (uvs.empty())
+            return;
+        const uint32_t i0 = indices[3 * size_t(tri)];
+        const uint32_t i1 = indices[3 * size_t(tri) + 1];
+        const uint32_t i2 = indices[3 * size_t(tri) + 2];
+        const real b0 = 1.0 - b1 - b2;
+        tex_u = b0 * uvs[i0].x + b1 * uvs[i1].x + b2 * uvs[i2].x;
+        tex_v = b0 * uvs[i0].y + b1 * uvs[i1].y + b2 * uvs[i2].y;
+    }
+};
+
+#endif
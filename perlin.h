@@ -18,7 +18,7 @@ public:
         perlin_generate_perm(perm_z);
     }
 
-    double noise(const point3 &p) const
+    real noise(const point3 &p) const
     {
         auto u = p.x - std::floor(p.x);
         auto v = p.y - std::floor(p.y);
@@ -42,7 +42,7 @@ public:
         return perlin_interp(c, u, v, w);
     }
 
-    double turb(const point3 &p, int depth) const
+    real turb(const point3 &p, int depth) const
     {
         auto accum = 0.0;
         auto temp_p = p;
@@ -84,7 +84,7 @@ private:
         }
     }
 
-    static double perlin_interp(const vec3 c[2][2][2], double u, double v, double w)
+    static real perlin_interp(const vec3 c[2][2][2], real u, real v, real w)
     {
         auto uu = u * u * (3 - 2 * u);
         auto vv = v * v * (3 - 2 * v);
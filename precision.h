@@ -0,0 +1,13 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+// Scalar type of geometry, rays, colors and textures. Configure with -DRT_SINGLE_PRECISION=ON
+// (CMake) to build with float, which halves the size of the math types; random numbers and
+// build-time bookkeeping stay in double either way.
+#ifdef RT_SINGLE_PRECISION
+using real = float;
+#else
+using real = double;
+#endif
+
+#endif
@@ -2,6 +2,7 @@
 #define QUAD_H
 
 #include "hittable.h"
+#include "material.h"
 
 class quad : public hittable
 {
@@ -17,8 +18,10 @@ public:
         normal = unit_vector(n);
         D = dot(normal, Q);
         w = n / dot(n, n);
+        area = n.length();
 
         set_bounding_box();
+        p_error_bound = rounding_gamma(7) * bbox.max_abs_coordinate();
     }
 
     virtual void set_bounding_box()
@@ -52,16 +55,70 @@ public:
         if (!is_interior(alpha, beta, rec))
             return false;
 
-        // Ray hits the 2D shape; set the rest of the hit record and return true.
+        // Ray hits the 2D shape; the rest of the hit record is filled in by finalize().
         rec.t = t;
         rec.p = intersection;
-        rec.mat = mat;
-        rec.set_face_normal(r, normal);
+        rec.mat = mat_id;
+        rec.object = this;
+        rec.instance_depth = 0;
 
         return true;
     }
 
-    virtual bool is_interior(double a, double b, hit_record &rec) const
+    void finalize(const ray &r, hit_record &rec) const override
+    {
+        rec.p = rec.p - (dot(normal, rec.p) - D) * normal; // Snap onto the plane
+        rec.p_error = p_error_bound;
+        rec.set_face_normal(r, normal);
+        rec.uv_scale = 1 / std::sqrt(area); // u and v each span one edge
+    }
+
+    real pdf_value(const point3 &origin, const vec3 &direction) const override
+    {
+        // Uniform over the area, converted to solid angle at origin.
+        hit_record rec;
+        if (!this->hit(ray(origin, direction), interval(0, infinity), rec))
+            return 0;
+
+        auto distance_squared = rec.t * rec.t * direction.length_squared();
+        auto cosine = std::fabs(dot(direction, normal) / direction.length());
+        if (cosine <= 0)
+            return 0;
+
+        return distance_squared / (cosine * area);
+    }
+
+    vec3 random(const point3 &origin) const override
+    {
+        double a, b;
+        random_2d(a, b);
+        auto p = Q + (a * u) + (b * v);
+        return p - origin;
+    }
+
+    void collect_emitters(std::vector<const hittable *> &emitters) const override
+    {
+        if (mat->is_emissive())
+            emitters.push_back(this);
+    }
+
+    void register_materials(material_table &table) override { mat_id = table.add(mat); }
+
+    light_bounds emitter_bounds() const override
+    {
+        // diffuse_light emits from both faces.
+        point3 c = Q + u / 2 + v / 2;
+        light_bounds b;
+        b.box = bbox;
+        b.axis = normal;
+        b.cos_theta_o = 1;
+        b.cos_theta_e = 0;
+        b.two_sided = true;
+        b.power = luminance(mat->emitted(0.5, 0.5, c)) * 2 * area * pi;
+        return b;
+    }
+
+    virtual bool is_interior(real a, real b, hit_record &rec) const
     {
         interval unit_interval = interval(0, 1);
         // Given the hit point in plane coordinates, return false if it is outside the
@@ -80,9 +137,12 @@ private:
     vec3 u, v;
     vec3 w;
     shared_ptr<material> mat;
+    material_id mat_id = 0; // mat's index in the scene's material table
     aabb bbox;
     vec3 normal;
-    double D;
+    real D;
+    real area;
+    real p_error_bound; // Rounding error of a hit point snapped onto the plane
 };
 
 inline shared_ptr<hittable_list> box(const point3 &a, const point3 &b, shared_ptr<material> mat)
@@ -1,12 +1,18 @@
 #ifndef RAY_H
 #define RAY_H
 
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
 class ray
 {
 public:
     vec3 origin;
     vec3 direction;
-    double time;
+    real time;
 
     ray()
     {
@@ -22,17 +28,62 @@ public:
         time = 0.0;
     }
 
-    ray(vec3 vecA, vec3 vecB, double num)
+    ray(vec3 vecA, vec3 vecB, real num)
     {
         origin = vecA;
         direction = vecB;
         time = num;
     }
 
-    vec3 at(double t) const
+    vec3 at(real t) const
     {
         return origin + (direction * t);
     }
 };
 
+// Bound on the relative error of n chained floating point operations carried out in T. Hits
+// found by kernels that work in float (the mesh packets) need the float bound whatever real is.
+template <typename T = real>
+constexpr real rounding_gamma(int n)
+{
+    constexpr real half_epsilon = real(std::numeric_limits<T>::epsilon()) / 2;
+    return n * half_epsilon / (1 - n * half_epsilon);
+}
+
+inline real offset_ray_coordinate(real p, real n)
+{
+    // Moves p by a number of ulps of real proportional to n; near zero, where ulps get tiny, by a
+    // fixed small distance instead. The constants are tuned for float and shrink with the
+    // precision of real, so double builds push origins 2^29 times less far.
+    constexpr real precision = std::numeric_limits<real>::epsilon() / std::numeric_limits<float>::epsilon();
+    constexpr real origin = real(1) / 32;
+    constexpr real float_scale = precision / 65536;
+    constexpr real int_scale = 256;
+
+    if (std::fabs(p) < origin)
+        return p + float_scale * n;
+
+    using bits_type = std::conditional_t<sizeof(real) == sizeof(int32_t), int32_t, int64_t>;
+    bits_type bits;
+    std::memcpy(&bits, &p, sizeof(bits));
+    bits += (p < 0 ? -1 : 1) * bits_type(int_scale * n);
+    real moved;
+    std::memcpy(&moved, &bits, sizeof(moved));
+    return moved;
+}
+
+// Origin for a ray leaving surface point p in direction w: p pushed off the surface along the
+// unit geometric normal n, to the side w leaves on, so rays can be traced from t = 0 at any
+// scene scale. The push covers a few ulps of p (Wachter and Binder, "A Fast and Robust
+// Method for Avoiding Self-Intersection", Ray Tracing Gems, 2019) plus the error bound p_error
+// the intersector reported for p.
+inline point3 offset_ray_origin(const point3 &p, real p_error, const vec3 &n, const vec3 &w)
+{
+    const vec3 out = dot(n, w) < 0 ? -n : n;
+    const point3 q = p + (p_error * (std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z))) * out;
+    return point3(offset_ray_coordinate(q.x, out.x),
+                  offset_ray_coordinate(q.y, out.y),
+                  offset_ray_coordinate(q.z, out.z));
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,212 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "raytracer.h"
+#include "simd.h"
+
+#include <cstdint>
+#include <limits>
+
+constexpr int ray_packet_size = 8;
+
+// Rays traced together by hittable::hit_packet(), such as neighbouring camera rays. Lanes are
+// independent; they trace fastest when the rays start close together and point the same way.
+struct ray_packet
+{
+    ray rays[ray_packet_size];
+    interval ranges[ray_packet_size]; // Per lane; max shrinks to the closest hit found so far
+
+    // Sample stream of each lane, swapped in while its hits are tested (constant media draw from
+    // it), so a lane consumes the values it would have consumed traced alone. Null lanes use the
+    // thread's stream.
+    rng_stream *streams[ray_packet_size] = {};
+
+    // Whether the active rays all point into the same octant, so they tend to visit the same
+    // nodes. Diverging packets are better traced one ray at a time.
+    bool coherent(unsigned active) const
+    {
+        int octant = -1;
+        for (; active; active &= active - 1)
+        {
+            const vec3 &d = rays[lowest_bit(active)].direction;
+            int o = (d.x < 0 ? 1 : 0) | (d.y < 0 ? 2 : 0) | (d.z < 0 ? 4 : 0);
+            if (octant >= 0 && o != octant)
+                return false;
+            octant = o;
+        }
+        return true;
+    }
+};
+
+// A packet in the layout of the SIMD box tests: single precision, one array per coordinate.
+struct alignas(32) packet_rays
+{
+    float origin[3][ray_packet_size];
+    float inv_dir[3][ray_packet_size];
+    float tmin[ray_packet_size];
+    float tmax[ray_packet_size];
+
+    packet_rays(const ray_packet &packet, unsigned active)
+    {
+        for (int lane = 0; lane < ray_packet_size; lane++)
+        {
+            const ray &r = packet.rays[lane];
+            const real orig[3] = {r.origin.x, r.origin.y, r.origin.z};
+            const real dir[3] = {r.direction.x, r.direction.y, r.direction.z};
+            for (int axis = 0; axis < 3; axis++)
+            {
+                origin[axis][lane] = float(orig[axis]);
+                inv_dir[axis][lane] = float(1 / dir[axis]);
+            }
+            tmin[lane] = float(packet.ranges[lane].min);
+            tmax[lane] = (active & (1u << lane)) ? far_bound(packet.ranges[lane].max) : -1.0f;
+        }
+    }
+
+    void set_tmax(int lane, double t) { tmax[lane] = far_bound(t); }
+
+    // t rounded up to float, so the lane tests never cut a range short.
+    static float far_bound(double t)
+    {
+        float f = float(t);
+        return double(f) < t ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+};
+
+namespace packet_kernels
+{
+    // Far slab distances are scaled up by this factor so that float rounding can only add false
+    // positives (as in wide_bvh_kernels).
+    constexpr float far_scale = 1.0000004f;
+
+    // The box tests take count boxes, box b spanning bmin[axis][b] to bmax[axis][b]. masks[b] is
+    // set to the active lanes whose ray crosses box b within its range, and tnear[b] to the entry
+    // distance of the first of them.
+    inline void box_test_scalar(const float *const bmin[3], const float *const bmax[3], int count,
+                                const packet_rays &p, unsigned active, unsigned *masks, float *tnear)
+    {
+        for (int b = 0; b < count; b++)
+        {
+            masks[b] = 0;
+            for (unsigned rest = active; rest; rest &= rest - 1)
+            {
+                const int lane = lowest_bit(rest);
+                float lo = p.tmin[lane], hi = p.tmax[lane];
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    float t0 = (bmin[axis][b] - p.origin[axis][lane]) * p.inv_dir[axis][lane];
+                    float t1 = (bmax[axis][b] - p.origin[axis][lane]) * p.inv_dir[axis][lane];
+                    lo = std::max(lo, std::min(t0, t1));
+                    hi = std::min(hi, std::max(t0, t1) * far_scale);
+                }
+                if (lo <= hi)
+                {
+                    if (!masks[b])
+                        tnear[b] = lo;
+                    masks[b] |= 1u << lane;
+                }
+            }
+        }
+    }
+
+#if RT_SIMD_X86
+    inline void box_test_sse(const float *const bmin[3], const float *const bmax[3], int count, const packet_rays &p,
+                             unsigned active, unsigned *masks, float *tnear)
+    {
+        // Four lanes at a time; halves without active lanes are skipped.
+        for (int b = 0; b < count; b++)
+            masks[b] = 0;
+        const __m128 scale = _mm_set1_ps(far_scale);
+        for (int k = ray_packet_size - 4; k >= 0; k -= 4)
+        {
+            if (!((active >> k) & 0xF))
+                continue;
+            const __m128 tmin = _mm_load_ps(p.tmin + k);
+            const __m128 tmax = _mm_load_ps(p.tmax + k);
+            __m128 o[3], inv[3];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                o[axis] = _mm_load_ps(p.origin[axis] + k);
+                inv[axis] = _mm_load_ps(p.inv_dir[axis] + k);
+            }
+            for (int b = 0; b < count; b++)
+            {
+                __m128 lo = tmin, hi = tmax;
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin[axis][b]), o[axis]), inv[axis]);
+                    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax[axis][b]), o[axis]), inv[axis]);
+                    lo = _mm_max_ps(lo, _mm_min_ps(t0, t1));
+                    hi = _mm_min_ps(hi, _mm_mul_ps(_mm_max_ps(t0, t1), scale));
+                }
+                const unsigned half = unsigned(_mm_movemask_ps(_mm_cmple_ps(lo, hi))) & ((active >> k) & 0xF);
+                if (half)
+                {
+                    // The lower half runs last, so tnear ends up from the lowest lane.
+                    alignas(16) float near[4];
+                    _mm_store_ps(near, lo);
+                    tnear[b] = near[lowest_bit(half)];
+                    masks[b] |= half << k;
+                }
+            }
+        }
+    }
+
+    RT_TARGET_AVX2 inline void box_test_avx2(const float *const bmin[3], const float *const bmax[3], int count,
+                                             const packet_rays &p, unsigned active, unsigned *masks, float *tnear)
+    {
+        // All eight lanes at once; only called after cpu_has_avx2() succeeded.
+        const __m256 scale = _mm256_set1_ps(far_scale);
+        const __m256 tmin = _mm256_load_ps(p.tmin);
+        const __m256 tmax = _mm256_load_ps(p.tmax);
+        __m256 o[3], inv[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            o[axis] = _mm256_load_ps(p.origin[axis]);
+            inv[axis] = _mm256_load_ps(p.inv_dir[axis]);
+        }
+        for (int b = 0; b < count; b++)
+        {
+            __m256 lo = tmin, hi = tmax;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bmin[axis][b]), o[axis]), inv[axis]);
+                __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bmax[axis][b]), o[axis]), inv[axis]);
+                lo = _mm256_max_ps(lo, _mm256_min_ps(t0, t1));
+                hi = _mm256_min_ps(hi, _mm256_mul_ps(_mm256_max_ps(t0, t1), scale));
+            }
+            masks[b] = unsigned(_mm256_movemask_ps(_mm256_cmp_ps(lo, hi, _CMP_LE_OQ))) & active;
+            if (masks[b])
+            {
+                alignas(32) float near[8];
+                _mm256_store_ps(near, lo);
+                tnear[b] = near[lowest_bit(masks[b])];
+            }
+        }
+    }
+#endif
+
+    using box_test_fn = void (*)(const float *const[3], const float *const[3], int, const packet_rays &, unsigned,
+                                 unsigned *, float *);
+
+    inline box_test_fn select_box_test()
+    {
+#if RT_SIMD_X86
+        if (cpu_has_avx2())
+            return box_test_avx2;
+        return box_test_sse;
+#else
+        return box_test_scalar;
+#endif
+    }
+
+    // Tests boxes against the active lanes of a packet, with the best kernel for this CPU.
+    inline void box_test(const float *const bmin[3], const float *const bmax[3], int count, const packet_rays &p,
+                         unsigned active, unsigned *masks, float *tnear)
+    {
+        static const box_test_fn test = select_box_test();
+        test(bmin, bmax, count, p, active, masks, tnear);
+    }
+}
+
+#endif
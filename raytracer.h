@@ -5,27 +5,36 @@
 #include <iostream>
 #include <limits>
 #include <memory>
-#include <cstdlib>
-#include <random>
+
+#include "precision.h"
+#include "rng.h"
 
 // C++ Std Usings
 using std::make_shared;
 using std::shared_ptr;
 
 // Constants
-const double infinity = std::numeric_limits<double>::infinity();
-const double pi = 3.1415926535897932385;
+const real infinity = std::numeric_limits<real>::infinity();
+const real pi = real(3.1415926535897932385);
 
 // Utility Functions
-inline double degrees_to_radians(double degrees)
+inline real degrees_to_radians(real degrees)
 {
-    return degrees * pi / 180.0;
+    return degrees * pi / 180;
 }
 
 inline double random_double()
 {
-    // Returns a random real in [0,1).
-    return std::rand() / (RAND_MAX + 1.0);
+    // Returns a random real in [0,1) from the calling thread's sample stream.
+    return thread_rng().next_double();
+}
+
+inline void random_2d(double &u, double &v)
+{
+    // Returns a point in [0,1)^2 from the calling thread's sample stream. Stratified samplers
+    // spread these pairs jointly, so 2D warps should draw from here rather than from two
+    // random_double() calls.
+    thread_rng().next_2d(u, v);
 }
 
 inline double random_double(double min, double max)
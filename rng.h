@@ -0,0 +1,110 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+// SplitMix64 finalizer; also used to hash sampler seeds.
+inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+// Identifies one sample of one pixel, and the render seed.
+struct sample_key
+{
+    uint32_t x = 0, y = 0;
+    uint32_t sample = 0;
+    uint32_t seed = 0;
+};
+
+// Source of the values a pixel sample consumes, one dimension at a time. Dimensions are counted
+// per (pixel, sample) by rng_stream; a 2D draw uses a single dimension. Samplers hold no
+// per-sample state, so one instance serves every render thread. See sampler.h for the
+// stratified ones.
+class sampler
+{
+public:
+    virtual ~sampler() = default;
+
+    // Value in [0,1) of the given dimension.
+    virtual double get_1d(const sample_key &key, uint32_t dimension) const = 0;
+
+    // Point in [0,1)^2 for the given dimension, stratified jointly where the sampler can.
+    virtual void get_2d(const sample_key &key, uint32_t dimension, double &u, double &v) const = 0;
+};
+
+// Counter-based random numbers: every value is a pure hash of (seed, pixel, sample, dimension),
+// so there is no shared generator state. A stream seeded for one (pixel, sample) pair always
+// yields the same sequence, whichever thread draws it and in whatever order pixels are traced.
+class independent_sampler : public sampler
+{
+public:
+    double get_1d(const sample_key &key, uint32_t dimension) const override
+    {
+        return to_unit(mix64(stream_key(key) + 0x9E3779B97F4A7C15ull * (uint64_t(dimension) + 1)));
+    }
+
+    void get_2d(const sample_key &key, uint32_t dimension, double &u, double &v) const override
+    {
+        uint64_t base = stream_key(key) + 0x9E3779B97F4A7C15ull * (uint64_t(dimension) + 1);
+        u = to_unit(mix64(base));
+        v = to_unit(mix64(base ^ 0xD1B54A32D192ED03ull));
+    }
+
+private:
+    static uint64_t stream_key(const sample_key &key)
+    {
+        uint64_t pixel = uint64_t(key.y) << 16 ^ key.x;
+        return mix64((pixel << 32 | key.sample) ^ mix64(uint64_t(key.seed) + 1));
+    }
+
+    static double to_unit(uint64_t bits)
+    {
+        return (bits >> 11) * (1.0 / 9007199254740992.0); // 53 random mantissa bits / 2^53
+    }
+};
+
+// The sample stream of one thread: the sampler in use, the current (pixel, sample) pair and the
+// next dimension.
+class rng_stream
+{
+public:
+    // Restarts the stream for one sample of one pixel. Dimension counting starts again at zero.
+    // A null source means independent random numbers.
+    void start(const sample_key &sample, const sampler *source = nullptr)
+    {
+        key = sample;
+        values = source ? source : &independent;
+        dimension = 0;
+    }
+
+    uint32_t current_dimension() const { return dimension; }
+
+    // Returns the value for the next dimension as a real in [0,1).
+    double next_double() { return values->get_1d(key, dimension++); }
+
+    // Returns a point in [0,1)^2, using one dimension.
+    void next_2d(double &u, double &v) { values->get_2d(key, dimension++, u, v); }
+
+private:
+    static inline const independent_sampler independent;
+
+    sample_key key;
+    const sampler *values = &independent;
+    uint32_t dimension = 0;
+};
+
+inline rng_stream &thread_rng()
+{
+    // The stream used by random_double() on the calling thread. The camera restarts it for each
+    // pixel sample; outside of rendering (scene setup) it runs from a fixed default seed.
+    thread_local rng_stream stream;
+    return stream;
+}
+
+#endif
@@ -10,9 +10,16 @@
 #define STBI_FAILURE_USERMSG
 #include "external/stb_image.h"
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <cstdlib>
 #include <iostream>
+#include <vector>
 
+// An image and its mip chain, stored once in the smallest format that keeps its range: 8-bit
+// gamma encoded values for ordinary images, linear floats for HDR files. Each level is laid out
+// in 8x8 texel tiles, so texels that are close in 2D are close in memory too.
 class rtw_image
 {
 public:
@@ -33,48 +40,91 @@ public:
         std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
     }
 
-    ~rtw_image()
-    {
-        delete[] bdata;
-        STBI_FREE(fdata);
-    }
-
     bool load(const std::string &filename)
     {
-        auto n = bytes_per_pixel; // Dummy out parameter: original components per pixel
-        fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
-        if (fdata == nullptr)
-            return false;
-
-        bytes_per_scanline = image_width * bytes_per_pixel;
-        convert_to_bytes();
+        // The decoded buffer is copied into tiles and freed straight away.
+        int w = 0, h = 0, n = 0; // n: original components per pixel, unused
+        if (stbi_is_hdr(filename.c_str()))
+        {
+            float *decoded = stbi_loadf(filename.c_str(), &w, &h, &n, channels);
+            if (decoded == nullptr)
+                return false;
+            hdr = true;
+            layout(w, h);
+            store(0, decoded, linear);
+            STBI_FREE(decoded);
+        }
+        else
+        {
+            unsigned char *decoded = stbi_load(filename.c_str(), &w, &h, &n, channels);
+            if (decoded == nullptr)
+                return false;
+            hdr = false;
+            layout(w, h);
+            store(0, decoded, encoded);
+            STBI_FREE(decoded);
+        }
+        build_mips();
         return true;
     }
 
-    int width() const { return (fdata == nullptr) ? 0 : image_width; }
-    int height() const { return (fdata == nullptr) ? 0 : image_height; }
+    int width() const { return mips.empty() ? 0 : mips[0].width; }
+    int height() const { return mips.empty() ? 0 : mips[0].height; }
 
-    const unsigned char *pixel_data(int x, int y) const
-    {
-        // Return the address of the three RGB bytes of the pixel at x,y. If there is no image
-        // data, returns magenta.
-        static unsigned char magenta[] = {255, 0, 255};
-        if (bdata == nullptr)
-            return magenta;
+    // Mip chain. Level 0 is the image itself; each further level halves both sides (rounding
+    // down, but at least 1) until a single pixel remains.
+    int mip_levels() const { return int(mips.size()); }
+    int mip_width(int level) const { return mips[level].width; }
+    int mip_height(int level) const { return mips[level].height; }
 
-        x = clamp(x, 0, image_width);
-        y = clamp(y, 0, image_height);
+    // Linear RGB of the texel at x,y of a mip level, clamped to its edges. If there is no image
+    // data, returns magenta.
+    void texel(int level, int x, int y, float rgb[3]) const
+    {
+        if (mips.empty())
+        {
+            rgb[0] = 1;
+            rgb[1] = 0;
+            rgb[2] = 1;
+            return;
+        }
 
-        return bdata + y * bytes_per_scanline + x * bytes_per_pixel;
+        const mip_level &m = mips[level];
+        const size_t at = channels * index(m, clamp(x, 0, m.width), clamp(y, 0, m.height));
+        if (hdr)
+        {
+            for (int c = 0; c < channels; c++)
+                rgb[c] = linear[at + c];
+        }
+        else
+        {
+            const unsigned char *e = &encoded[at];
+            rgb[0] = decode[e[0]];
+            rgb[1] = decode[e[1]];
+            rgb[2] = decode[e[2]];
+        }
     }
 
+    // Bytes held by the texels of every level.
+    size_t memory_bytes() const { return encoded.capacity() + linear.capacity() * sizeof(float); }
+
 private:
-    const int bytes_per_pixel = 3;
-    float *fdata = nullptr;         // Linear floating point pixel data
-    unsigned char *bdata = nullptr; // Linear 8-bit pixel data
-    int image_width = 0;            // Loaded image width
-    int image_height = 0;           // Loaded image height
-    int bytes_per_scanline = 0;
+    static constexpr int channels = 3;
+    static constexpr int tile_shift = 3; // 8x8 texel tiles
+    static constexpr int tile_size = 1 << tile_shift;
+
+    struct mip_level
+    {
+        int width, height;
+        int tiles_x;  // Tiles per row
+        size_t first; // Index of the level's first texel
+    };
+
+    bool hdr = false;
+    const float *decode = decode_table().data();
+    std::vector<mip_level> mips;        // Empty until an image is loaded
+    std::vector<unsigned char> encoded; // Texels of every level, unless hdr
+    std::vector<float> linear;          // Texels of every level, if hdr
 
     static int clamp(int x, int low, int high)
     {
@@ -86,30 +136,127 @@ private:
         return high - 1;
     }
 
-    static unsigned char float_to_byte(float value)
+    // Texel number of x,y: tiles are stored row by row, and texels row by row inside a tile.
+    static size_t index(const mip_level &m, int x, int y)
     {
-        if (value <= 0.0)
+        const size_t tile = size_t(y >> tile_shift) * m.tiles_x + size_t(x >> tile_shift);
+        return m.first + (tile << (2 * tile_shift)) + size_t((y & (tile_size - 1)) << tile_shift) +
+               size_t(x & (tile_size - 1));
+    }
+
+    // 8-bit values decode the way stb_image converts them to floats (gamma 2.2).
+    static const std::array<float, 256> &decode_table()
+    {
+        static const std::array<float, 256> table = []
+        {
+            std::array<float, 256> t;
+            for (int i = 0; i < 256; i++)
+                t[i] = float(std::pow(i / 255.0f, 2.2f));
+            return t;
+        }();
+        return table;
+    }
+
+    // The 8-bit value whose decoded value is nearest to v.
+    static unsigned char encode(float v)
+    {
+        const auto &table = decode_table();
+        const auto above = std::lower_bound(table.begin(), table.end(), v);
+        if (above == table.begin())
             return 0;
-        if (1.0 <= value)
+        if (above == table.end())
             return 255;
-        return static_cast<unsigned char>(256.0 * value);
+        const auto below = above - 1;
+        return static_cast<unsigned char>(((v - *below) < (*above - v) ? below : above) - table.begin());
     }
 
-    void convert_to_bytes()
+    // Sets up the levels of a w by h image and sizes the texel storage for them.
+    void layout(int w, int h)
     {
-        // Convert the linear floating point pixel data to bytes, storing the resulting byte
-        // data in the `bdata` member.
+        mips.clear();
+        size_t total = 0;
+        while (true)
+        {
+            const int tiles_x = (w + tile_size - 1) / tile_size;
+            const int tiles_y = (h + tile_size - 1) / tile_size;
+            mips.push_back({w, h, tiles_x, total});
+            total += size_t(tiles_x) * tiles_y * tile_size * tile_size;
+            if (w == 1 && h == 1)
+                break;
+            w = std::max(1, w / 2);
+            h = std::max(1, h / 2);
+        }
 
-        int total_bytes = image_width * image_height * bytes_per_pixel;
-        bdata = new unsigned char[total_bytes];
+        encoded.clear();
+        linear.clear();
+        if (hdr)
+            linear.assign(total * channels, 0.0f);
+        else
+            encoded.assign(total * channels, 0);
+        encoded.shrink_to_fit();
+        linear.shrink_to_fit();
+    }
 
-        // Iterate through all pixel components, converting from [0.0, 1.0] float values to
-        // unsigned [0, 255] byte values.
+    // Copies a level from scanline order into its tiles.
+    template <typename T>
+    void store(int level, const T *scanlines, std::vector<T> &texels)
+    {
+        const mip_level &m = mips[level];
+        for (int y = 0; y < m.height; y++)
+            for (int x = 0; x < m.width; x++)
+                std::copy_n(scanlines + (size_t(y) * m.width + x) * channels, channels,
+                            texels.data() + channels * index(m, x, y));
+    }
 
-        auto *bptr = bdata;
-        auto *fptr = fdata;
-        for (auto i = 0; i < total_bytes; i++, fptr++, bptr++)
-            *bptr = float_to_byte(*fptr);
+    void build_mips()
+    {
+        // Each level averages 2x2 blocks of the one above it, in linear floating point so rounding
+        // does not build up from level to level; the last row or column of an odd sized level is
+        // folded into the block before it. Only the previous level is kept in floats meanwhile.
+        std::vector<float> above, level;
+        for (size_t l = 1; l < mips.size(); l++)
+        {
+            const mip_level &src = mips[l - 1], &dst = mips[l];
+            level.assign(size_t(dst.width) * dst.height * channels, 0.0f);
+            for (int y = 0; y < dst.height; y++)
+            {
+                const int y0 = 2 * y;
+                const int y1 = (y == dst.height - 1) ? src.height - 1 : std::min(2 * y + 1, src.height - 1);
+                for (int x = 0; x < dst.width; x++)
+                {
+                    const int x0 = 2 * x;
+                    const int x1 = (x == dst.width - 1) ? src.width - 1 : std::min(2 * x + 1, src.width - 1);
+                    float *out = &level[(size_t(y) * dst.width + x) * channels];
+                    for (int sy = y0; sy <= y1; sy++)
+                        for (int sx = x0; sx <= x1; sx++)
+                        {
+                            float rgb[channels];
+                            if (l == 1)
+                                texel(0, sx, sy, rgb);
+                            else
+                                std::copy_n(&above[(size_t(sy) * src.width + sx) * channels], channels, rgb);
+                            for (int c = 0; c < channels; c++)
+                                out[c] += rgb[c];
+                        }
+                    const float n = float((y1 - y0 + 1) * (x1 - x0 + 1));
+                    for (int c = 0; c < channels; c++)
+                        out[c] /= n;
+                }
+            }
+
+            if (hdr)
+            {
+                store(int(l), level.data(), linear);
+            }
+            else
+            {
+                std::vector<unsigned char> bytes(level.size());
+                for (size_t i = 0; i < level.size(); i++)
+                    bytes[i] = encode(level[i]);
+                store(int(l), bytes.data(), encoded);
+            }
+            above.swap(level);
+        }
     }
 };
 
@@ -118,4 +265,4 @@ private:
 #pragma warning(pop)
 #endif
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,191 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rng.h"
+
+#include <memory>
+
+// Stratified samplers for the camera. Both use the first two dimensions of the Sobol sequence,
+// randomized with hash-based Owen scrambling (Burley, "Practical Hash-based Owen Scrambling",
+// 2020); each dimension the path consumes gets its own scramble, so consecutive 1D and 2D draws
+// stay uncorrelated.
+
+enum class sampler_type
+{
+    independent, // Uncorrelated random numbers (rng.h)
+    sobol,       // Owen-scrambled Sobol points per pixel
+    blue_noise   // Sobol points spread over pixels in Morton order, so the error is blue noise
+};
+
+namespace sobol
+{
+    inline uint32_t reverse_bits(uint32_t x)
+    {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+        x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+        x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+        x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+        return x;
+    }
+
+    // Sobol dimension 0 (van der Corput) and 1 of a point, as 32-bit fractions.
+    inline uint32_t dimension0(uint32_t index) { return reverse_bits(index); }
+
+    inline uint32_t dimension1(uint32_t index)
+    {
+        // Direction numbers of the polynomial x + 1: v[k] = v[k - 1] ^ (v[k - 1] >> 1)
+        uint32_t result = 0;
+        for (uint32_t v = 0x80000000u; index; index >>= 1, v ^= v >> 1)
+            if (index & 1)
+                result ^= v;
+        return result;
+    }
+
+    // Laine-Karras style hash that only lets each bit depend on lower bits; applied to
+    // bit-reversed values it is a nested uniform (Owen) scramble.
+    inline uint32_t owen_scramble(uint32_t x, uint32_t seed)
+    {
+        x = reverse_bits(x);
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return reverse_bits(x);
+    }
+
+    inline double to_unit(uint32_t bits) { return bits * (1.0 / 4294967296.0); }
+
+    inline uint32_t hash(uint64_t a, uint64_t b) { return uint32_t(mix64(a * 0x9E3779B97F4A7C15ull ^ mix64(b))); }
+}
+
+// Sobol points per pixel. The sample index is shuffled and the point scrambled with seeds hashed
+// from the pixel, dimension and render seed.
+class sobol_sampler : public sampler
+{
+public:
+    double get_1d(const sample_key &key, uint32_t dimension) const override
+    {
+        uint32_t seed = dimension_seed(key, dimension);
+        uint32_t index = sobol::owen_scramble(key.sample, seed);
+        return sobol::to_unit(sobol::owen_scramble(sobol::dimension0(index), sobol::hash(seed, 1)));
+    }
+
+    void get_2d(const sample_key &key, uint32_t dimension, double &u, double &v) const override
+    {
+        uint32_t seed = dimension_seed(key, dimension);
+        uint32_t index = sobol::owen_scramble(key.sample, seed);
+        u = sobol::to_unit(sobol::owen_scramble(sobol::dimension0(index), sobol::hash(seed, 1)));
+        v = sobol::to_unit(sobol::owen_scramble(sobol::dimension1(index), sobol::hash(seed, 2)));
+    }
+
+private:
+    static uint32_t dimension_seed(const sample_key &key, uint32_t dimension)
+    {
+        uint64_t pixel = uint64_t(key.y) << 32 | key.x;
+        return sobol::hash(sobol::hash(pixel, key.seed), dimension);
+    }
+};
+
+// Sobol points shared across the image: pixel (x, y) takes the samples whose indices follow its
+// Morton code, with the base-4 digits of that code randomly permuted level by level (Ahmed and
+// Wonka, "Screen-Space Blue-Noise Diffusion of Monte Carlo Sampling Error via Hierarchical
+// Ordering of Pixels", 2020). Neighbouring pixels then get well-spread points, which leaves the
+// remaining error as high-frequency blue noise instead of white noise.
+class blue_noise_sampler : public sampler
+{
+public:
+    blue_noise_sampler(int image_width, int image_height, int samples_per_pixel)
+    {
+        int resolution = image_width > image_height ? image_width : image_height;
+        while ((1 << log2_resolution) < resolution)
+            log2_resolution++;
+        while ((1 << log2_samples) < samples_per_pixel)
+            log2_samples++;
+        base4_digits = log2_resolution + (log2_samples + 1) / 2;
+    }
+
+    double get_1d(const sample_key &key, uint32_t dimension) const override
+    {
+        uint32_t seed = sobol::hash(key.seed, dimension);
+        uint32_t index = sample_index(key, dimension);
+        return sobol::to_unit(sobol::owen_scramble(sobol::dimension0(index), seed));
+    }
+
+    void get_2d(const sample_key &key, uint32_t dimension, double &u, double &v) const override
+    {
+        uint32_t seed = sobol::hash(key.seed, dimension);
+        uint32_t index = sample_index(key, dimension);
+        u = sobol::to_unit(sobol::owen_scramble(sobol::dimension0(index), sobol::hash(seed, 1)));
+        v = sobol::to_unit(sobol::owen_scramble(sobol::dimension1(index), sobol::hash(seed, 2)));
+    }
+
+private:
+    int log2_resolution = 0;
+    int log2_samples = 0;
+    int base4_digits = 0;
+
+    static uint64_t morton_2d(uint32_t x, uint32_t y)
+    {
+        auto spread = [](uint64_t v)
+        {
+            v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+            v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+            v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+            v = (v | (v << 2)) & 0x3333333333333333ull;
+            v = (v | (v << 1)) & 0x5555555555555555ull;
+            return v;
+        };
+        return (spread(y) << 1) | spread(x);
+    }
+
+    uint32_t sample_index(const sample_key &key, uint32_t dimension) const
+    {
+        // All 24 permutations of the four digits 0-3
+        static const uint8_t permutations[24][4] = {
+            {0, 1, 2, 3}, {0, 1, 3, 2}, {0, 2, 1, 3}, {0, 2, 3, 1}, {0, 3, 2, 1}, {0, 3, 1, 2},
+            {1, 0, 2, 3}, {1, 0, 3, 2}, {1, 2, 0, 3}, {1, 2, 3, 0}, {1, 3, 2, 0}, {1, 3, 0, 2},
+            {2, 1, 0, 3}, {2, 1, 3, 0}, {2, 0, 1, 3}, {2, 0, 3, 1}, {2, 3, 0, 1}, {2, 3, 1, 0},
+            {3, 1, 2, 0}, {3, 1, 0, 2}, {3, 2, 1, 0}, {3, 2, 0, 1}, {3, 0, 2, 1}, {3, 0, 1, 2}};
+
+        const uint64_t morton_index = (morton_2d(key.x, key.y) << log2_samples) | key.sample;
+
+        // With an odd number of sample bits the lowest digit is binary.
+        const bool odd_samples = log2_samples & 1;
+        uint64_t index = 0;
+        for (int digit_number = base4_digits - 1; digit_number >= (odd_samples ? 1 : 0); digit_number--)
+        {
+            const int shift = 2 * digit_number - (odd_samples ? 1 : 0);
+            const int digit = int((morton_index >> shift) & 3);
+            const uint64_t higher_digits = morton_index >> (shift + 2);
+            const int p = int((mix64(higher_digits ^ (0x55555555ull * dimension)) >> 24) % 24);
+            index |= uint64_t(permutations[p][digit]) << shift;
+        }
+        if (odd_samples)
+        {
+            const uint64_t digit = morton_index & 1;
+            index |= digit ^ (mix64((morton_index >> 1) ^ (0x55555555ull * dimension)) & 1);
+        }
+
+        // The 32-bit Sobol matrices ignore higher index bits; those only separate pixels far
+        // apart, whose points are decorrelated by the digit permutations instead.
+        return uint32_t(index);
+    }
+};
+
+inline std::shared_ptr<sampler> make_sampler(sampler_type type, int image_width, int image_height,
+                                             int samples_per_pixel)
+{
+    switch (type)
+    {
+    case sampler_type::sobol:
+        return std::make_shared<sobol_sampler>();
+    case sampler_type::blue_noise:
+        return std::make_shared<blue_noise_sampler>(image_width, image_height, samples_per_pixel);
+    default:
+        return std::make_shared<independent_sampler>();
+    }
+}
+
+#endif
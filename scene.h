@@ -0,0 +1,29 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "hittable_list.h"
+#include "material.h"
+
+// A world to render: its objects, and the table of the materials they use. The scene owns the
+// table; camera::render() rebuilds it from the objects before each frame, so the ids primitives
+// report always index the scene being rendered. Objects shared between scenes take the ids of
+// whichever was registered last, so such scenes must not render at the same time.
+class scene : public hittable_list
+{
+public:
+    material_table materials;
+
+    scene() {}
+    scene(shared_ptr<hittable> object) : hittable_list(object) {}
+
+    using hittable_list::register_materials;
+
+    // Refills materials from the objects and hands every primitive its material id.
+    void register_materials()
+    {
+        materials.clear();
+        hittable_list::register_materials(materials);
+    }
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing scheduler over a fixed set of task indices [0, task_count).
+// Each worker owns a queue seeded with a contiguous run of tasks. Workers pop from the front of
+// their own queue (keeping neighbouring tiles on one core) and, once it runs dry, steal from the
+// back of another worker's queue.
+class work_stealing_scheduler
+{
+public:
+    work_stealing_scheduler(int task_count, int worker_count)
+        : queues(std::max(1, worker_count))
+    {
+        const int workers = static_cast<int>(queues.size());
+        for (int w = 0; w < workers; w++)
+        {
+            int begin = static_cast<int>((static_cast<long long>(task_count) * w) / workers);
+            int end = static_cast<int>((static_cast<long long>(task_count) * (w + 1)) / workers);
+            for (int task = begin; task < end; task++)
+                queues[w].tasks.push_back(task);
+        }
+    }
+
+    int worker_count() const { return static_cast<int>(queues.size()); }
+
+    // Fetches the next task for a worker. Returns false once every queue is empty.
+    bool next(int worker, int &task)
+    {
+        if (pop_front(queues[worker], task))
+            return true;
+
+        const int workers = worker_count();
+        for (int offset = 1; offset < workers; offset++)
+        {
+            if (pop_back(queues[(worker + offset) % workers], task))
+                return true;
+        }
+        return false;
+    }
+
+    // Runs body(worker, task) for every task on worker_count() threads (the caller is worker 0).
+    void run(const std::function<void(int, int)> &body)
+    {
+        auto worker_loop = [&](int worker)
+        {
+            int task;
+            while (next(worker, task))
+                body(worker, task);
+        };
+
+        std::vector<std::thread> threads;
+        for (int w = 1; w < worker_count(); w++)
+            threads.emplace_back(worker_loop, w);
+
+        worker_loop(0);
+
+        for (auto &t : threads)
+            t.join();
+    }
+
+    static int resolve_thread_count(int requested)
+    {
+        // Returns the requested thread count, or the hardware concurrency for values <= 0.
+        if (requested > 0)
+            return requested;
+        int hw = static_cast<int>(std::thread::hardware_concurrency());
+        return hw > 0 ? hw : 1;
+    }
+
+private:
+    struct task_queue
+    {
+        std::mutex lock;
+        std::deque<int> tasks;
+    };
+
+    std::vector<task_queue> queues;
+
+    static bool pop_front(task_queue &q, int &task)
+    {
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.tasks.empty())
+            return false;
+        task = q.tasks.front();
+        q.tasks.pop_front();
+        return true;
+    }
+
+    static bool pop_back(task_queue &q, int &task)
+    {
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.tasks.empty())
+            return false;
+        task = q.tasks.back();
+        q.tasks.pop_back();
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// SIMD support shared by the wide BVH and other vectorized kernels.
+//
+// The binary is built for the baseline instruction set of the target (SSE2 on x86-64), so it still
+// runs on older hosts. Kernels that want AVX2 are compiled for it individually with
+// RT_TARGET_AVX2 and are only called when cpu_has_avx2() reports support at runtime.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RT_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#else
+#define RT_SIMD_X86 0
+#endif
+
+#if RT_SIMD_X86 && (defined(__GNUC__) || defined(__clang__))
+#define RT_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define RT_TARGET_AVX2
+#endif
+
+inline bool cpu_has_avx2()
+{
+#if !RT_SIMD_X86
+    return false;
+#elif defined(__GNUC__) || defined(__clang__)
+    static const bool supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return supported;
+#elif defined(_MSC_VER)
+    static const bool supported = []
+    {
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return false;
+
+        __cpuid(info, 1);
+        bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+        bool fma = (info[2] & (1 << 12)) != 0;
+
+        __cpuidex(info, 7, 0);
+        bool avx2 = (info[1] & (1 << 5)) != 0;
+        return os_saves_ymm && fma && avx2;
+    }();
+    return supported;
+#else
+    return false;
+#endif
+}
+
+// Index of the lowest set bit of a non-zero mask.
+inline int lowest_bit(unsigned mask)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return int(index);
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+#endif
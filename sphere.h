@@ -4,22 +4,25 @@
 #include "vec3.h"
 #include "ray.h"
 #include "hittable.h"
+#include "material.h"
+#include "onb.h"
 
 class sphere : public hittable
 {
 public:
     // Stationary Sphere
-    sphere(const point3 &static_center, double radius_input, shared_ptr<material> mat_input)
+    sphere(const point3 &static_center, real radius_input, shared_ptr<material> mat_input)
     {
         center = ray(static_center, vec3(0, 0, 0));
         radius = std::fmax(0, radius_input);
         mat = mat_input;
         auto rvec = vec3(radius, radius, radius);
         bbox = aabb(static_center - rvec, static_center + rvec);
+        p_error_bound = rounding_gamma(5) * bbox.max_abs_coordinate();
     }
 
     // Moving Sphere
-    sphere(const point3 &center1, const point3 &center2, double radius_input,
+    sphere(const point3 &center1, const point3 &center2, real radius_input,
            shared_ptr<material> mat_input)
     {
         center = ray(center1, center2 - center1);
@@ -29,6 +32,7 @@ public:
         aabb box1(center.at(0) - rvec, center.at(0) + rvec);
         aabb box2(center.at(1) - rvec, center.at(1) + rvec);
         bbox = aabb(box1, box2);
+        p_error_bound = rounding_gamma(5) * bbox.max_abs_coordinate();
     }
 
     aabb bounding_box() const override { return bbox; }
@@ -36,51 +40,122 @@ public:
     // Ray/sphere intersections
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
-        // Ray-sphere intersection using the simplified quadratic
+        // Ray-sphere intersection using the simplified quadratic, arranged to avoid cancellation
+        // (Haines et al., "Precision Improvements for Ray/Sphere Intersection", Ray Tracing Gems,
+        // 2019). The plain form loses most of its digits on big spheres in single precision.
         point3 current_center = center.at(r.time);
         vec3 oc = current_center - r.origin;
         auto a = r.direction.length_squared();
         auto h = dot(r.direction, oc);
-        auto c = oc.length_squared() - radius * radius;
-        auto discriminant = h * h - a * c;
+
+        // h^2 - a*c, computed from the distance between the center and the ray's line
+        vec3 l = oc - (h / a) * r.direction;
+        auto discriminant = a * (radius - l.length()) * (radius + l.length());
 
         if (discriminant < 0)
             return false;
 
         auto sqrtd = std::sqrt(discriminant);
 
+        // The two roots, without subtracting nearly equal numbers
+        auto oc_length = oc.length();
+        auto c = (oc_length - radius) * (oc_length + radius);
+        auto q = h + std::copysign(sqrtd, h);
+        if (q == 0)
+            return false; // Both roots sit at the origin of a ray that only grazes the sphere there
+        auto near_root = c / q, far_root = q / a;
+        if (near_root > far_root)
+            std::swap(near_root, far_root);
+
         // Find the nearest root that lies in the acceptable range
-        auto root = (h - sqrtd) / a;
+        auto root = near_root;
         if (!ray_t.surrounds(root))
         {
-            root = (h + sqrtd) / a;
+            root = far_root;
             if (!ray_t.surrounds(root))
                 return false;
         }
 
         rec.t = root;
+        rec.mat = mat_id;
+        rec.object = this;
+        rec.instance_depth = 0;
+
+        return true;
+    }
+
+    void finalize(const ray &r, hit_record &rec) const override
+    {
+        // Project the point back onto the sphere, which removes most of the rounding error of
+        // r.at() so spawned rays only need a small offset.
+        point3 current_center = center.at(r.time);
         rec.p = r.at(rec.t);
+        rec.p = current_center + (rec.p - current_center) * (radius / (rec.p - current_center).length());
+        rec.p_error = p_error_bound;
 
         // Outward normal and front-face logic
         vec3 outward_normal = (rec.p - current_center) / radius;
         rec.set_face_normal(r, outward_normal);
 
         get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.uv_scale = 1 / (pi * radius * std::sqrt(real(2))); // u spans 2 pi radius, v pi radius
+    }
 
-        // Material
-        rec.mat = mat;
+    real pdf_value(const point3 &origin, const vec3 &direction) const override
+    {
+        // Uniform over the cone of directions the sphere subtends. Stationary spheres only.
+        hit_record rec;
+        if (!this->hit(ray(origin, direction), interval(0, infinity), rec))
+            return 0;
+
+        auto dist_squared = (center.at(0) - origin).length_squared();
+        if (dist_squared <= radius * radius)
+            return 0;
+        auto cos_theta_max = std::sqrt(1 - radius * radius / dist_squared);
+        auto solid_angle = 2 * pi * (1 - cos_theta_max);
+
+        return 1 / solid_angle;
+    }
 
-        return true;
+    vec3 random(const point3 &origin) const override
+    {
+        vec3 direction = center.at(0) - origin;
+        auto distance_squared = direction.length_squared();
+        onb uvw(direction);
+        return uvw.transform(random_to_sphere(radius, distance_squared));
+    }
+
+    void collect_emitters(std::vector<const hittable *> &emitters) const override
+    {
+        // Moving spheres are left out: the sampled cone would lag behind the sphere.
+        if (mat->is_emissive() && center.direction.length_squared() == 0)
+            emitters.push_back(this);
+    }
+
+    void register_materials(material_table &table) override { mat_id = table.add(mat); }
+
+    light_bounds emitter_bounds() const override
+    {
+        // Emits from every normal direction; power is radiance * area * pi.
+        point3 c = center.at(0);
+        light_bounds b;
+        b.box = bbox;
+        b.cos_theta_o = -1;
+        b.cos_theta_e = 0;
+        b.power = luminance(mat->emitted(0.5, 0.5, c)) * 4 * pi * radius * radius * pi;
+        return b;
     }
 
 private:
     ray center;
-    double radius;
+    real radius;
     shared_ptr<material> mat;
+    material_id mat_id = 0; // mat's index in the scene's material table
     aabb bbox;
+    real p_error_bound; // Rounding error of a projected hit point, relative to the scene origin
 
     // Textured spheres
-    static void get_sphere_uv(const point3 &p, double &u, double &v)
+    static void get_sphere_uv(const point3 &p, real &u, real &v)
     {
         auto theta = std::acos(-p.y);
         auto phi = std::atan2(-p.z, p.x) + pi;
@@ -88,6 +163,21 @@ private:
         u = phi / (2 * pi);
         v = theta / pi;
     }
+
+    // Random direction inside the cone subtended by a sphere of the given radius, at squared
+    // distance distance_squared along +z.
+    static vec3 random_to_sphere(real radius, real distance_squared)
+    {
+        double r1, r2;
+        random_2d(r1, r2);
+        auto z = 1 + r2 * (std::sqrt(std::fmax(real(0), 1 - radius * radius / distance_squared)) - 1);
+
+        auto phi = 2 * pi * r1;
+        auto x = std::cos(phi) * std::sqrt(std::fmax(real(0), 1 - z * z));
+        auto y = std::sin(phi) * std::sqrt(std::fmax(real(0), 1 - z * z));
+
+        return vec3(x, y, z);
+    }
 };
 
 #endif
@@ -5,12 +5,23 @@
 #include "raytracer.h"
 #include "rtw_stb_image.h"
 
+#include <cstdint>
+#include <vector>
+
 class texture
 {
 public:
     virtual ~texture() = default;
 
-    virtual color value(double u, double v, const point3 &p) const = 0;
+    virtual color value(real u, real v, const point3 &p) const = 0;
+
+    // value() averaged over a footprint about width wide in texture coordinates, as seen by the
+    // ray that hit p. Textures that cannot filter point sample.
+    virtual color filtered_value(real u, real v, const point3 &p, real width) const
+    {
+        (void)width;
+        return value(u, v, p);
+    }
 };
 
 class solid_color : public texture
@@ -21,7 +32,7 @@ public:
         albedo = color(0, 0, 0);
     }
 
-    solid_color(double red, double green, double blue)
+    solid_color(real red, real green, real blue)
     {
         albedo = color(red, green, blue);
     }
@@ -31,7 +42,7 @@ public:
         albedo = albedo_input;
     }
 
-    color value(double u, double v, const point3 &p) const override
+    color value(real u, real v, const point3 &p) const override
     {
         return albedo;
     }
@@ -43,21 +54,21 @@ private:
 class checker_texture : public texture
 {
 public:
-    checker_texture(double scale, shared_ptr<texture> even_input, shared_ptr<texture> odd_input)
+    checker_texture(real scale, shared_ptr<texture> even_input, shared_ptr<texture> odd_input)
     {
         inv_scale = 1.0 / scale;
         even = even_input;
         odd = odd_input;
     }
 
-    checker_texture(double scale, const color &c1, const color &c2)
+    checker_texture(real scale, const color &c1, const color &c2)
     {
         inv_scale = scale;
         even = make_shared<solid_color>(c1);
         odd = make_shared<solid_color>(c2);
     }
 
-    color value(double u, double v, const point3 &p) const override
+    color value(real u, real v, const point3 &p) const override
     {
         auto xInteger = int(std::floor(inv_scale * p.x));
         auto yInteger = int(std::floor(inv_scale * p.y));
@@ -68,8 +79,19 @@ public:
         return isEven ? even->value(u, v, p) : odd->value(u, v, p);
     }
 
+    color filtered_value(real u, real v, const point3 &p, real width) const override
+    {
+        auto xInteger = int(std::floor(inv_scale * p.x));
+        auto yInteger = int(std::floor(inv_scale * p.y));
+        auto zInteger = int(std::floor(inv_scale * p.z));
+
+        bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+
+        return isEven ? even->filtered_value(u, v, p, width) : odd->filtered_value(u, v, p, width);
+    }
+
 private:
-    double inv_scale;
+    real inv_scale;
     shared_ptr<texture> even;
     shared_ptr<texture> odd;
 };
@@ -87,65 +109,233 @@ public:
     {
     }
 
-    image_texture(const char *filename, double u_off, double v_off)
+    image_texture(const char *filename, real u_off, real v_off)
         : image(filename), u_offset(u_off), v_offset(v_off)
     {
     }
 
-    color value(double u, double v, const point3 &p) const override
+    color value(real u, real v, const point3 &p) const override
+    {
+        if (image.height() <= 0)
+            return color(0, 1, 1);
+
+        int i, j;
+        texel_index(u, v, i, j);
+        return texel(i, j);
+    }
+
+    // Trilinear lookup: bilinear in the two mip levels whose texels are closest to width, blended
+    // by how far between them it lies.
+    color filtered_value(real u, real v, const point3 &p, real width) const override
     {
+        (void)p;
         if (image.height() <= 0)
             return color(0, 1, 1);
 
-        // Apply offsets
+        const int last = image.mip_levels() - 1;
+        real lod = 0;
+        if (width > 0)
+            lod = std::fmin(std::fmax(std::log2(width * std::sqrt(real(image.width()) * image.height())), real(0)),
+                            real(last));
+
+        const int level = static_cast<int>(lod);
+        const real blend = lod - level;
+        color c = bilinear(level, u, v);
+        if (blend > 0 && level < last)
+            c = (1 - blend) * c + blend * bilinear(level + 1, u, v);
+        return c;
+    }
+
+    // Size of the image in texels; 0 if it failed to load.
+    int width() const { return image.width(); }
+    int height() const { return image.height(); }
+
+    // The texel value() reads at (u, v): offset, wrapped, and with v flipped into image rows.
+    void texel_index(real u, real v, int &i, int &j) const
+    {
+        i = wrapped_index(u + u_offset, image.width(), false);
+        j = wrapped_index(v + v_offset, image.height(), true);
+    }
+
+    color texel(int i, int j) const
+    {
+        float rgb[3];
+        image.texel(0, i, j, rgb);
+        return color(rgb[0], rgb[1], rgb[2]);
+    }
+
+    // The columns (or rows, if vertical) value() can read for u (or v) between lo and hi, as up
+    // to two inclusive index ranges, since wrapping can split the span. Returns the range count.
+    int texel_spans(real lo, real hi, bool vertical, int spans[2][2]) const
+    {
+        const int size = vertical ? image.height() : image.width();
+        const real offset = vertical ? v_offset : u_offset;
+        lo += offset;
+        hi += offset;
+        if (hi - lo >= 1)
+        {
+            spans[0][0] = 0;
+            spans[0][1] = size - 1;
+            return 1;
+        }
+
+        const int a = wrapped_index(lo, size, vertical);
+        const int b = wrapped_index(hi, size, vertical);
+        if (std::floor(lo) == std::floor(hi))
+        {
+            spans[0][0] = std::min(a, b);
+            spans[0][1] = std::max(a, b);
+            return 1;
+        }
+
+        // [lo, ceil(lo)) runs to one edge of the image and [floor(hi), hi] from the other.
+        spans[0][0] = vertical ? 0 : a;
+        spans[0][1] = vertical ? a : size - 1;
+        spans[1][0] = vertical ? b : 0;
+        spans[1][1] = vertical ? size - 1 : b;
+        return 2;
+    }
+
+private:
+    rtw_image image;
+    real u_offset;
+    real v_offset;
+
+    color bilinear(int level, real u, real v) const
+    {
+        const int w = image.mip_width(level), h = image.mip_height(level);
         u = u + u_offset;
         v = v + v_offset;
-
-        // Wrap UV
         u = u - floor(u);
-        v = v - floor(v);
+        v = 1.0 - (v - floor(v));
+
+        // Texel centres sit at half-integer positions; neighbours wrap around the edges.
+        const real x = u * w - real(0.5), y = v * h - real(0.5);
+        const real x_floor = std::floor(x), y_floor = std::floor(y);
+        const real fx = x - x_floor, fy = y - y_floor;
+        const int x0 = (int(x_floor) + w) % w, y0 = (int(y_floor) + h) % h;
+        const int x1 = (x0 + 1) % w, y1 = (y0 + 1) % h;
+
+        auto fetch = [&](int i, int j)
+        {
+            float rgb[3];
+            image.texel(level, i, j, rgb);
+            return color(rgb[0], rgb[1], rgb[2]);
+        };
+        const color top = (1 - fx) * fetch(x0, y0) + fx * fetch(x1, y0);
+        const color bottom = (1 - fx) * fetch(x0, y1) + fx * fetch(x1, y1);
+        return (1 - fy) * top + fy * bottom;
+    }
+
+    static int wrapped_index(real t, int size, bool flip)
+    {
+        t = t - floor(t);
+        if (flip)
+            t = 1.0 - t;
+        return std::min(static_cast<int>(t * size), size - 1);
+    }
+};
 
-        // Flip V for image coordinates
-        v = 1.0 - v;
+// How much of a triangle an alpha cutout lets through.
+enum class alpha_coverage
+{
+    opaque,
+    transparent,
+    mixed
+};
 
-        // Convert to pixel space
-        int i = static_cast<int>(u * image.width());
-        int j = static_cast<int>(v * image.height());
+// Whether an opacity value passes an alpha cutoff: white is opaque while black is transparent.
+inline bool passes_cutoff(const color &a, real cutoff)
+{
+    real av = (a.x + a.y + a.z) / 3.0;
+    return av >= cutoff;
+}
 
-        // Clamp to valid pixel indices
-        i = std::min(i, image.width() - 1);
-        j = std::min(j, image.height() - 1);
+// An opacity image reduced to one bit per texel, set where it passes the cutoff. Cutout tests
+// read a bit instead of a texel, and whole triangles can be classified against it up front.
+class coverage_mask
+{
+public:
+    coverage_mask(shared_ptr<image_texture> opacity, real cutoff)
+        : source(opacity), width(opacity->width()), height(opacity->height())
+    {
+        words_per_row = (width + 63) / 64;
+        bits.assign(size_t(words_per_row) * height, 0);
+        for (int j = 0; j < height; j++)
+            for (int i = 0; i < width; i++)
+                if (passes_cutoff(source->texel(i, j), cutoff))
+                    bits[size_t(j) * words_per_row + i / 64] |= uint64_t(1) << (i % 64);
+    }
 
-        auto pixel = image.pixel_data(i, j);
+    bool covered(real u, real v) const
+    {
+        int i, j;
+        source->texel_index(u, v, i, j);
+        return (bits[size_t(j) * words_per_row + i / 64] >> (i % 64)) & 1;
+    }
+
+    // Classifies a triangle with texture coordinates (u[k], v[k]) at its corners by every texel
+    // in its UV bounding box, which covers every texel a hit on it can read.
+    alpha_coverage classify(const real u[3], const real v[3]) const
+    {
+        real u_lo = std::fmin(u[0], std::fmin(u[1], u[2])), u_hi = std::fmax(u[0], std::fmax(u[1], u[2]));
+        real v_lo = std::fmin(v[0], std::fmin(v[1], v[2])), v_hi = std::fmax(v[0], std::fmax(v[1], v[2]));
 
-        const double color_scale = 1.0 / 255.0;
-        return color(color_scale * pixel[0],
-                     color_scale * pixel[1],
-                     color_scale * pixel[2]);
+        // Interpolated hit coordinates can round slightly past the corners.
+        const real u_pad = real(1e-5) * (1 + std::fmax(std::fabs(u_lo), std::fabs(u_hi)));
+        const real v_pad = real(1e-5) * (1 + std::fmax(std::fabs(v_lo), std::fabs(v_hi)));
+        int columns[2][2], rows[2][2];
+        const int column_spans = source->texel_spans(u_lo - u_pad, u_hi + u_pad, false, columns);
+        const int row_spans = source->texel_spans(v_lo - v_pad, v_hi + v_pad, true, rows);
+
+        bool any_set = false, any_clear = false;
+        for (int r = 0; r < row_spans; r++)
+            for (int j = rows[r][0]; j <= rows[r][1]; j++)
+                for (int c = 0; c < column_spans; c++)
+                {
+                    const uint64_t *row = &bits[size_t(j) * words_per_row];
+                    const int first = columns[c][0], last = columns[c][1];
+                    for (int w = first / 64; w <= last / 64; w++)
+                    {
+                        uint64_t span = ~uint64_t(0);
+                        if (w == first / 64)
+                            span &= ~uint64_t(0) << (first % 64);
+                        if (w == last / 64)
+                            span &= ~uint64_t(0) >> (63 - last % 64);
+                        any_set |= (row[w] & span) != 0;
+                        any_clear |= (~row[w] & span) != 0;
+                    }
+                    if (any_set && any_clear)
+                        return alpha_coverage::mixed;
+                }
+        return any_set ? alpha_coverage::opaque : alpha_coverage::transparent;
     }
 
+    size_t memory_bytes() const { return bits.capacity() * sizeof(uint64_t); }
+
 private:
-    rtw_image image;
-    double u_offset;
-    double v_offset;
+    shared_ptr<image_texture> source; // Maps (u, v) to texels
+    int width, height;
+    int words_per_row;
+    std::vector<uint64_t> bits;
 };
 
 class noise_texture : public texture
 {
 public:
-    noise_texture(double scale_input)
+    noise_texture(real scale_input)
     {
         scale = scale_input;
     }
 
-    color value(double u, double v, const point3 &p) const override
+    color value(real u, real v, const point3 &p) const override
     {
         return color(.5, .5, .5) * (1 + std::sin(scale * p.z + 10 * noise.turb(p, 7)));
     }
 
 private:
     perlin noise;
-    double scale;
+    real scale;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,163 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "raytracer.h"
+#include "aabb.h"
+
+// Affine transform stored as a row-major 3x4 matrix: the linear part in columns 0-2 and the
+// translation in column 3.
+class affine_transform
+{
+public:
+    real m[3][4];
+
+    affine_transform()
+    {
+        for (int row = 0; row < 3; row++)
+            for (int col = 0; col < 4; col++)
+                m[row][col] = (row == col) ? 1.0 : 0.0;
+    }
+
+    static affine_transform translation(const vec3 &offset)
+    {
+        affine_transform t;
+        t.m[0][3] = offset.x;
+        t.m[1][3] = offset.y;
+        t.m[2][3] = offset.z;
+        return t;
+    }
+
+    static affine_transform scaling(const vec3 &factors)
+    {
+        affine_transform t;
+        t.m[0][0] = factors.x;
+        t.m[1][1] = factors.y;
+        t.m[2][2] = factors.z;
+        return t;
+    }
+
+    static affine_transform rotation_x(real degrees)
+    {
+        real c = std::cos(degrees_to_radians(degrees)), s = std::sin(degrees_to_radians(degrees));
+        affine_transform t;
+        t.m[1][1] = c;
+        t.m[1][2] = -s;
+        t.m[2][1] = s;
+        t.m[2][2] = c;
+        return t;
+    }
+
+    static affine_transform rotation_y(real degrees)
+    {
+        // Same convention as rotate_y: +x turns towards -z.
+        real c = std::cos(degrees_to_radians(degrees)), s = std::sin(degrees_to_radians(degrees));
+        affine_transform t;
+        t.m[0][0] = c;
+        t.m[0][2] = s;
+        t.m[2][0] = -s;
+        t.m[2][2] = c;
+        return t;
+    }
+
+    static affine_transform rotation_z(real degrees)
+    {
+        real c = std::cos(degrees_to_radians(degrees)), s = std::sin(degrees_to_radians(degrees));
+        affine_transform t;
+        t.m[0][0] = c;
+        t.m[0][1] = -s;
+        t.m[1][0] = s;
+        t.m[1][1] = c;
+        return t;
+    }
+
+    // Composition: (a * b) applies b first, then a.
+    affine_transform operator*(const affine_transform &b) const
+    {
+        affine_transform t;
+        for (int row = 0; row < 3; row++)
+        {
+            for (int col = 0; col < 4; col++)
+            {
+                real v = (col == 3) ? m[row][3] : 0.0;
+                for (int k = 0; k < 3; k++)
+                    v += m[row][k] * b.m[k][col];
+                t.m[row][col] = v;
+            }
+        }
+        return t;
+    }
+
+    affine_transform inverse() const
+    {
+        // Invert the linear part with the adjugate, then map the translation back through it.
+        real a = m[0][0], b = m[0][1], c = m[0][2];
+        real d = m[1][0], e = m[1][1], f = m[1][2];
+        real g = m[2][0], h = m[2][1], i = m[2][2];
+
+        real A = e * i - f * h, B = -(d * i - f * g), C = d * h - e * g;
+        real det = a * A + b * B + c * C;
+        real inv_det = 1.0 / det;
+
+        affine_transform t;
+        t.m[0][0] = A * inv_det;
+        t.m[0][1] = -(b * i - c * h) * inv_det;
+        t.m[0][2] = (b * f - c * e) * inv_det;
+        t.m[1][0] = B * inv_det;
+        t.m[1][1] = (a * i - c * g) * inv_det;
+        t.m[1][2] = -(a * f - c * d) * inv_det;
+        t.m[2][0] = C * inv_det;
+        t.m[2][1] = -(a * h - b * g) * inv_det;
+        t.m[2][2] = (a * e - b * d) * inv_det;
+
+        for (int row = 0; row < 3; row++)
+            t.m[row][3] = -(t.m[row][0] * m[0][3] + t.m[row][1] * m[1][3] + t.m[row][2] * m[2][3]);
+        return t;
+    }
+
+    point3 apply_point(const point3 &p) const
+    {
+        return point3(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                      m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                      m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    vec3 apply_vector(const vec3 &v) const
+    {
+        return vec3(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                    m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                    m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    vec3 apply_transpose(const vec3 &v) const
+    {
+        // Multiplies by the transposed linear part. Called on the inverse transform, this maps
+        // normals from object to world space.
+        return vec3(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+                    m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+                    m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+    }
+
+    aabb apply_box(const aabb &box) const
+    {
+        // Returns the box enclosing all eight transformed corners.
+        point3 min(infinity, infinity, infinity);
+        point3 max(-infinity, -infinity, -infinity);
+        for (int i = 0; i < 2; i++)
+        {
+            for (int j = 0; j < 2; j++)
+            {
+                for (int k = 0; k < 2; k++)
+                {
+                    point3 corner = apply_point(point3(i ? box.x.max : box.x.min,
+                                                       j ? box.y.max : box.y.min,
+                                                       k ? box.z.max : box.z.min));
+                    min = point3(std::fmin(min.x, corner.x), std::fmin(min.y, corner.y), std::fmin(min.z, corner.z));
+                    max = point3(std::fmax(max.x, corner.x), std::fmax(max.y, corner.y), std::fmax(max.z, corner.z));
+                }
+            }
+        }
+        return aabb(min, max);
+    }
+};
+
+#endif
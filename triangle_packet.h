@@ -0,0 +1,284 @@
+#ifndef TRIANGLE_PACKET_H
+#define TRIANGLE_PACKET_H
+
+#include "raytracer.h"
+#include "simd.h"
+#include <cmath>
+#include <cstdint>
+
+// W triangles (W = 4 or 8) gathered from a mesh's index and position buffers into float lanes,
+// so one SIMD test covers a whole BVH leaf without touching the index buffer.
+template <int W>
+struct alignas(32) triangle_packet
+{
+    float v0[3][W];
+    float v1[3][W];
+    float v2[3][W];
+};
+
+// Per-ray setup of the watertight test (Woo, Benthin and Wald, "Watertight Ray/Triangle
+// Intersection", JCGT 2013). The ray is sheared so it runs along +z from the origin; triangles
+// are then tested with 2D edge functions, which agree exactly on shared edges, so rays can't
+// slip through the cracks between neighbouring triangles.
+struct watertight_ray
+{
+    int kx, ky, kz;    // kz is the dominant direction axis
+    float sx, sy, sz;  // Shear constants
+    double origin[3];
+    double shear[3];   // sx, sy, sz in double precision, for the fallback
+
+    watertight_ray() {}
+
+    explicit watertight_ray(const ray &r)
+    {
+        const double dir[3] = {r.direction.x, r.direction.y, r.direction.z};
+        origin[0] = r.origin.x;
+        origin[1] = r.origin.y;
+        origin[2] = r.origin.z;
+
+        kz = 0;
+        if (std::fabs(dir[1]) > std::fabs(dir[kz]))
+            kz = 1;
+        if (std::fabs(dir[2]) > std::fabs(dir[kz]))
+            kz = 2;
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (dir[kz] < 0)
+            std::swap(kx, ky); // Keep the winding, so the sign of the determinant is consistent
+
+        shear[0] = dir[kx] / dir[kz];
+        shear[1] = dir[ky] / dir[kz];
+        shear[2] = 1.0 / dir[kz];
+        sx = float(shear[0]);
+        sy = float(shear[1]);
+        sz = float(shear[2]);
+    }
+};
+
+namespace triangle_kernels
+{
+    // Results of testing one packet. Lanes whose bit is set in the returned mask hit within
+    // [tmin, tmax]; b1 and b2 are the barycentric weights of v1 and v2.
+    struct packet_hits
+    {
+        alignas(32) float t[8];
+        alignas(32) float b1[8];
+        alignas(32) float b2[8];
+    };
+
+    template <int W>
+    bool test_lane_double(const triangle_packet<W> &p, int lane, const watertight_ray &r, float tmin, float tmax,
+                          packet_hits &out)
+    {
+        // The float edge functions can round to exactly zero on or near an edge, where their
+        // sign decides the hit. Those lanes are redone in double precision, as the paper suggests.
+        const int k[3] = {r.kx, r.ky, r.kz};
+        double a[3], b[3], c[3];
+        for (int i = 0; i < 3; i++)
+        {
+            a[i] = double(p.v0[k[i]][lane]) - r.origin[k[i]];
+            b[i] = double(p.v1[k[i]][lane]) - r.origin[k[i]];
+            c[i] = double(p.v2[k[i]][lane]) - r.origin[k[i]];
+        }
+        const double ax = a[0] - r.shear[0] * a[2], ay = a[1] - r.shear[1] * a[2];
+        const double bx = b[0] - r.shear[0] * b[2], by = b[1] - r.shear[1] * b[2];
+        const double cx = c[0] - r.shear[0] * c[2], cy = c[1] - r.shear[1] * c[2];
+
+        const double u = cx * by - cy * bx;
+        const double v = ax * cy - ay * cx;
+        const double w = bx * ay - by * ax;
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+            return false;
+
+        const double det = u + v + w;
+        if (det == 0)
+            return false;
+
+        const double t = (u * a[2] + v * b[2] + w * c[2]) * r.shear[2] / det;
+        if (!(t >= tmin && t <= tmax))
+            return false;
+
+        out.t[lane] = float(t);
+        out.b1[lane] = float(v / det);
+        out.b2[lane] = float(w / det);
+        return true;
+    }
+
+    template <int W>
+    unsigned intersect_scalar(const triangle_packet<W> &p, const watertight_ray &r, unsigned valid, float tmin,
+                              float tmax, packet_hits &out)
+    {
+        const float ox = float(r.origin[r.kx]), oy = float(r.origin[r.ky]), oz = float(r.origin[r.kz]);
+        unsigned mask = 0;
+        for (int lane = 0; lane < W; lane++)
+        {
+            if (!(valid & (1u << lane)))
+                continue;
+
+            const float az = p.v0[r.kz][lane] - oz, bz = p.v1[r.kz][lane] - oz, cz = p.v2[r.kz][lane] - oz;
+            const float ax = (p.v0[r.kx][lane] - ox) - r.sx * az, ay = (p.v0[r.ky][lane] - oy) - r.sy * az;
+            const float bx = (p.v1[r.kx][lane] - ox) - r.sx * bz, by = (p.v1[r.ky][lane] - oy) - r.sy * bz;
+            const float cx = (p.v2[r.kx][lane] - ox) - r.sx * cz, cy = (p.v2[r.ky][lane] - oy) - r.sy * cz;
+
+            const float u = cx * by - cy * bx;
+            const float v = ax * cy - ay * cx;
+            const float w = bx * ay - by * ax;
+            if (u == 0 || v == 0 || w == 0)
+            {
+                if (test_lane_double(p, lane, r, tmin, tmax, out))
+                    mask |= 1u << lane;
+                continue;
+            }
+            if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+                continue;
+
+            const float det = u + v + w;
+            const float inv_det = 1.0f / det;
+            const float t = (u * az + v * bz + w * cz) * r.sz * inv_det;
+            if (!(t >= tmin && t <= tmax))
+                continue;
+
+            out.t[lane] = t;
+            out.b1[lane] = v * inv_det;
+            out.b2[lane] = w * inv_det;
+            mask |= 1u << lane;
+        }
+        return mask;
+    }
+
+#if RT_SIMD_X86
+    template <int W>
+    unsigned intersect_sse(const triangle_packet<W> &p, int k, const watertight_ray &r, unsigned valid, float tmin,
+                           float tmax, packet_hits &out)
+    {
+        // Tests lanes [k, k + 4) with SSE.
+        const __m128 ox = _mm_set1_ps(float(r.origin[r.kx]));
+        const __m128 oy = _mm_set1_ps(float(r.origin[r.ky]));
+        const __m128 oz = _mm_set1_ps(float(r.origin[r.kz]));
+        const __m128 sx = _mm_set1_ps(r.sx), sy = _mm_set1_ps(r.sy), sz = _mm_set1_ps(r.sz);
+        const __m128 zero = _mm_setzero_ps();
+
+        const __m128 az = _mm_sub_ps(_mm_loadu_ps(&p.v0[r.kz][k]), oz);
+        const __m128 bz = _mm_sub_ps(_mm_loadu_ps(&p.v1[r.kz][k]), oz);
+        const __m128 cz = _mm_sub_ps(_mm_loadu_ps(&p.v2[r.kz][k]), oz);
+        const __m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p.v0[r.kx][k]), ox), _mm_mul_ps(sx, az));
+        const __m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p.v0[r.ky][k]), oy), _mm_mul_ps(sy, az));
+        const __m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p.v1[r.kx][k]), ox), _mm_mul_ps(sx, bz));
+        const __m128 by = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p.v1[r.ky][k]), oy), _mm_mul_ps(sy, bz));
+        const __m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p.v2[r.kx][k]), ox), _mm_mul_ps(sx, cz));
+        const __m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p.v2[r.ky][k]), oy), _mm_mul_ps(sy, cz));
+
+        const __m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+        const __m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+        const __m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+        const __m128 any_neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+        const __m128 any_pos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+        const __m128 any_zero = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)), _mm_cmpeq_ps(w, zero));
+
+        const __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+        __m128 hit = _mm_andnot_ps(_mm_and_ps(any_neg, any_pos), _mm_cmpneq_ps(det, zero));
+
+        // Most tests fail the edge functions; skip the division for those packets.
+        const unsigned lanes = (valid >> k) & 0xF;
+        unsigned redo = unsigned(_mm_movemask_ps(any_zero)) & lanes;
+        if (!(unsigned(_mm_movemask_ps(hit)) & lanes) && !redo)
+            return 0;
+
+        const __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+        const __m128 t_scaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, az), _mm_mul_ps(v, bz)), _mm_mul_ps(w, cz));
+        const __m128 t = _mm_mul_ps(_mm_mul_ps(t_scaled, sz), inv_det);
+        hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(t, _mm_set1_ps(tmin)), _mm_cmple_ps(t, _mm_set1_ps(tmax))));
+
+        _mm_storeu_ps(&out.t[k], t);
+        _mm_storeu_ps(&out.b1[k], _mm_mul_ps(v, inv_det));
+        _mm_storeu_ps(&out.b2[k], _mm_mul_ps(w, inv_det));
+
+        unsigned mask = unsigned(_mm_movemask_ps(hit)) & lanes;
+        while (redo)
+        {
+            int lane = lowest_bit(redo);
+            redo &= redo - 1;
+            if (test_lane_double(p, k + lane, r, tmin, tmax, out))
+                mask |= 1u << lane;
+            else
+                mask &= ~(1u << lane);
+        }
+        return mask << k;
+    }
+
+    template <int W>
+    unsigned intersect_sse_lanes(const triangle_packet<W> &p, const watertight_ray &r, unsigned valid, float tmin,
+                                 float tmax, packet_hits &out)
+    {
+        unsigned mask = 0;
+        for (int k = 0; k < W; k += 4)
+            if ((valid >> k) & 0xF)
+                mask |= intersect_sse(p, k, r, valid, tmin, tmax, out);
+        return mask;
+    }
+
+    RT_TARGET_AVX2 inline unsigned intersect_avx2(const triangle_packet<8> &p, const watertight_ray &r,
+                                                  unsigned valid, float tmin, float tmax, packet_hits &out)
+    {
+        // Eight lanes with AVX2; only called after cpu_has_avx2() succeeded.
+        const __m256 ox = _mm256_set1_ps(float(r.origin[r.kx]));
+        const __m256 oy = _mm256_set1_ps(float(r.origin[r.ky]));
+        const __m256 oz = _mm256_set1_ps(float(r.origin[r.kz]));
+        const __m256 sx = _mm256_set1_ps(r.sx), sy = _mm256_set1_ps(r.sy), sz = _mm256_set1_ps(r.sz);
+        const __m256 zero = _mm256_setzero_ps();
+
+        const __m256 az = _mm256_sub_ps(_mm256_load_ps(p.v0[r.kz]), oz);
+        const __m256 bz = _mm256_sub_ps(_mm256_load_ps(p.v1[r.kz]), oz);
+        const __m256 cz = _mm256_sub_ps(_mm256_load_ps(p.v2[r.kz]), oz);
+        const __m256 ax = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p.v0[r.kx]), ox), _mm256_mul_ps(sx, az));
+        const __m256 ay = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p.v0[r.ky]), oy), _mm256_mul_ps(sy, az));
+        const __m256 bx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p.v1[r.kx]), ox), _mm256_mul_ps(sx, bz));
+        const __m256 by = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p.v1[r.ky]), oy), _mm256_mul_ps(sy, bz));
+        const __m256 cx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p.v2[r.kx]), ox), _mm256_mul_ps(sx, cz));
+        const __m256 cy = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p.v2[r.ky]), oy), _mm256_mul_ps(sy, cz));
+
+        const __m256 u = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+        const __m256 v = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+        const __m256 w = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+
+        const __m256 any_neg = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(v, zero, _CMP_LT_OQ)),
+                                            _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+        const __m256 any_pos = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, zero, _CMP_GT_OQ)),
+                                            _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+        const __m256 any_zero = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_EQ_OQ), _mm256_cmp_ps(v, zero, _CMP_EQ_OQ)),
+                                             _mm256_cmp_ps(w, zero, _CMP_EQ_OQ));
+
+        const __m256 det = _mm256_add_ps(_mm256_add_ps(u, v), w);
+        __m256 hit = _mm256_andnot_ps(_mm256_and_ps(any_neg, any_pos), _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+
+        unsigned redo = unsigned(_mm256_movemask_ps(any_zero)) & valid;
+        if (!(unsigned(_mm256_movemask_ps(hit)) & valid) && !redo)
+            return 0;
+
+        const __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+        const __m256 t_scaled = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, az), _mm256_mul_ps(v, bz)), _mm256_mul_ps(w, cz));
+        const __m256 t = _mm256_mul_ps(_mm256_mul_ps(t_scaled, sz), inv_det);
+        hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(tmin), _CMP_GE_OQ),
+                                               _mm256_cmp_ps(t, _mm256_set1_ps(tmax), _CMP_LE_OQ)));
+
+        _mm256_store_ps(out.t, t);
+        _mm256_store_ps(out.b1, _mm256_mul_ps(v, inv_det));
+        _mm256_store_ps(out.b2, _mm256_mul_ps(w, inv_det));
+
+        unsigned mask = unsigned(_mm256_movemask_ps(hit)) & valid;
+        while (redo)
+        {
+            int lane = lowest_bit(redo);
+            redo &= redo - 1;
+            if (test_lane_double(p, lane, r, tmin, tmax, out))
+                mask |= 1u << lane;
+            else
+                mask &= ~(1u << lane);
+        }
+        return mask;
+    }
+#endif
+}
+
+#endif
@@ -5,14 +5,17 @@
 #include <cmath>
 #include <stdexcept>
 
+#include "precision.h"
+
 double random_double();
 double random_double(double min, double max);
+void random_2d(double &u, double &v);
 
 class vec2
 {
 public:
-    double x;
-    double y;
+    real x;
+    real y;
 
     vec2()
     {
@@ -20,13 +23,13 @@ public:
         y = 0;
     }
 
-    vec2(double x1, double y1)
+    vec2(real x1, real y1)
     {
         x = x1;
         y = y1;
     }
 
-    double operator[](char c) const
+    real operator[](char c) const
     {
         switch (c)
         {
@@ -38,7 +41,7 @@ public:
         throw std::out_of_range("Invalid vec2 index");
     }
 
-    double operator[](int i) const
+    real operator[](int i) const
     {
         switch (i)
         {
@@ -50,7 +53,7 @@ public:
         throw std::out_of_range("Invalid vec2 index");
     }
 
-    double &operator[](int i)
+    real &operator[](int i)
     {
         switch (i)
         {
@@ -67,7 +70,7 @@ public:
         return vec2(this->x + v.x, this->y + v.y);
     }
 
-    vec2 operator+(double d) const
+    vec2 operator+(real d) const
     {
         return vec2(this->x + d, this->y + d);
     }
@@ -84,7 +87,7 @@ public:
         return vec2(this->x - v.x, this->y - v.y);
     }
 
-    vec2 operator-(double d) const
+    vec2 operator-(real d) const
     {
         return vec2(this->x - d, this->y - d);
     }
@@ -108,12 +111,12 @@ public:
         return vec2(this->x * v.x, this->y * v.y);
     }
 
-    vec2 operator*(double d) const
+    vec2 operator*(real d) const
     {
         return vec2(this->x * d, this->y * d);
     }
 
-    friend vec2 operator*(double d, const vec2 &v)
+    friend vec2 operator*(real d, const vec2 &v)
     {
         return vec2(v.x * d, v.y * d);
     }
@@ -128,7 +131,7 @@ public:
         return vec2(-this->x, -this->y);
     }
 
-    vec2 operator/(double d) const
+    vec2 operator/(real d) const
     {
         return vec2(this->x / d, this->y / d);
     }
@@ -155,17 +158,17 @@ public:
         return os;
     }
 
-    double length() const
+    real length() const
     {
         return (sqrt(x * x + y * y));
     }
 
-    double length_squared() const
+    real length_squared() const
     {
         return x * x + y * y;
     }
 
-    bool contains(const double &n)
+    bool contains(const real &n)
     {
         if (x == n || y == n)
             return true;
@@ -178,7 +181,7 @@ public:
         return vec2(random_double(), random_double());
     }
 
-    static vec2 random(double min, double max)
+    static vec2 random(real min, real max)
     {
         return vec2(random_double(min, max), random_double(min, max));
     }
@@ -5,15 +5,18 @@
 #include <cmath>
 #include <stdexcept>
 
+#include "precision.h"
+
 double random_double();
 double random_double(double min, double max);
+void random_2d(double &u, double &v);
 
 class vec3
 {
 public:
-    double x;
-    double y;
-    double z;
+    real x;
+    real y;
+    real z;
 
     vec3()
     {
@@ -22,14 +25,14 @@ public:
         z = 0;
     }
 
-    vec3(double x1, double y1, double z1)
+    vec3(real x1, real y1, real z1)
     {
         x = x1;
         y = y1;
         z = z1;
     }
 
-    double operator[](char c) const
+    real operator[](char c) const
     {
         switch (c)
         {
@@ -43,7 +46,7 @@ public:
         throw std::out_of_range("Invalid vec3 index");
     }
 
-    double operator[](int i) const
+    real operator[](int i) const
     {
         switch (i)
         {
@@ -57,7 +60,7 @@ public:
         throw std::out_of_range("Invalid vec3 index");
     }
 
-    double &operator[](int i)
+    real &operator[](int i)
     {
         switch (i)
         {
@@ -76,7 +79,7 @@ public:
         return vec3(this->x + v.x, this->y + v.y, this->z + v.z);
     }
 
-    vec3 operator+(double d) const
+    vec3 operator+(real d) const
     {
         return vec3(this->x + d, this->y + d, this->z + d);
     }
@@ -94,7 +97,7 @@ public:
         return vec3(this->x - v.x, this->y - v.y, this->z - v.z);
     }
 
-    vec3 operator-(double d) const
+    vec3 operator-(real d) const
     {
         return vec3(this->x - d, this->y - d, this->z - d);
     }
@@ -120,12 +123,12 @@ public:
         return vec3(this->x * v.x, this->y * v.y, this->z * v.z);
     }
 
-    vec3 operator*(double d) const
+    vec3 operator*(real d) const
     {
         return vec3(this->x * d, this->y * d, this->z * d);
     }
 
-    friend vec3 operator*(double d, const vec3 &v)
+    friend vec3 operator*(real d, const vec3 &v)
     {
         return vec3(v.x * d, v.y * d, v.z * d);
     }
@@ -140,7 +143,7 @@ public:
         return vec3(-this->x, -this->y, -this->z);
     }
 
-    vec3 operator/(double d) const
+    vec3 operator/(real d) const
     {
         return vec3(this->x / d, this->y / d, this->z / d);
     }
@@ -167,12 +170,12 @@ public:
         return os;
     }
 
-    double length() const
+    real length() const
     {
         return (sqrt(x * x + y * y + z * z));
     }
 
-    double length_squared() const
+    real length_squared() const
     {
         return x * x + y * y + z * z;
     }
@@ -183,7 +186,7 @@ public:
         return (fabs(x) < s) && (fabs(y) < s) && (fabs(z) < s);
     }
 
-    bool contains(const double &n)
+    bool contains(const real &n)
     {
         if (x == n || y == n || z == n)
             return true;
@@ -196,7 +199,7 @@ public:
         return vec3(random_double(), random_double(), random_double());
     }
 
-    static vec3 random(double min, double max)
+    static vec3 random(real min, real max)
     {
         return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
     }
@@ -211,17 +214,17 @@ inline vec3 unit_vector(const vec3 &v)
 
 inline vec3 random_unit_vector()
 {
-    while (true)
-    {
-        auto p = vec3::random(-1, 1);
-        auto lensq = p.length_squared();
-        if (lensq <= 1)
-            return p / sqrt(lensq);
-    }
+    // Uniform on the sphere by mapping a 2D sample directly (Archimedes: z is uniform).
+    double u, v;
+    random_2d(u, v);
+    real z = 1 - 2 * real(u);
+    real r = std::sqrt(std::fmax(real(0), 1 - z * z));
+    real phi = 2 * real(3.1415926535897932385) * real(v);
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
 }
 
 // Dot product
-inline double dot(const vec3 &v1, const vec3 &v2)
+inline real dot(const vec3 &v1, const vec3 &v2)
 {
     return ((v1.x * v2.x) + (v1.y * v2.y) + (v1.z * v2.z));
 }
@@ -240,7 +243,7 @@ inline vec3 reflect(const vec3 &v, const vec3 &n)
     return v - 2 * dot(v, n) * n;
 }
 
-inline vec3 refract(const vec3 &uv, const vec3 &n, double etai_over_etat)
+inline vec3 refract(const vec3 &uv, const vec3 &n, real etai_over_etat)
 {
     auto cos_theta = std::fmin(dot(-uv, n), 1.0);
     vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
@@ -258,12 +261,27 @@ inline vec3 cross(const vec3 &v1, const vec3 &v2)
 
 inline vec3 random_in_unit_disk()
 {
-    while (true)
+    // Concentric mapping of the square onto the disk (Shirley and Chiu), which keeps the
+    // stratification of the 2D sample.
+    double u, v;
+    random_2d(u, v);
+    real a = 2 * real(u) - 1, b = 2 * real(v) - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+
+    const real quarter_pi = real(3.1415926535897932385) / 4;
+    real r, theta;
+    if (std::fabs(a) > std::fabs(b))
+    {
+        r = a;
+        theta = quarter_pi * (b / a);
+    }
+    else
     {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() < 1)
-            return p;
+        r = b;
+        theta = 2 * quarter_pi - quarter_pi * (a / b);
     }
+    return vec3(r * std::cos(theta), r * std::sin(theta), 0);
 }
 
 #endif
\ No newline at end of file
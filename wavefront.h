@@ -0,0 +1,69 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "raytracer.h"
+#include "aabb.h"
+
+#include <cstdint>
+#include <vector>
+
+// Sort keys for the camera's wavefront integrator, which traces batches of paths one stage at a
+// time and reorders the active paths between stages.
+namespace wavefront
+{
+    // Spreads the low 9 bits of v so there are two zero bits between each of them.
+    inline uint32_t spread_bits(uint32_t v)
+    {
+        v &= 0x1FFu;
+        v = (v | (v << 16)) & 0x030000FFu;
+        v = (v | (v << 8)) & 0x0300F00Fu;
+        v = (v | (v << 4)) & 0x030C30C3u;
+        v = (v | (v << 2)) & 0x09249249u;
+        return v;
+    }
+
+    // 30-bit key grouping rays by direction octant, then by origin along a Morton curve over
+    // bounds (9 bits per axis). Rays with nearby keys tend to visit the same BVH nodes.
+    inline uint32_t ray_key(const ray &r, const aabb &bounds)
+    {
+        uint32_t octant = (r.direction.x < 0 ? 1u : 0u) | (r.direction.y < 0 ? 2u : 0u) |
+                          (r.direction.z < 0 ? 4u : 0u);
+        uint32_t q[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const interval &range = bounds.axis_interval(axis);
+            real t = range.size() > 0 ? (r.origin[axis] - range.min) / range.size() : 0;
+            q[axis] = uint32_t(std::fmin(std::fmax(t, real(0)), real(1)) * 511);
+        }
+        return octant << 27 | (spread_bits(q[0]) << 2) | (spread_bits(q[1]) << 1) | spread_bits(q[2]);
+    }
+
+    // Stable LSD radix sort of items by keys[item], looking only at the low key_bits bits.
+    inline void sort_by_key(std::vector<uint32_t> &items, const std::vector<uint32_t> &keys, int key_bits,
+                            std::vector<uint32_t> &scratch)
+    {
+        scratch.resize(items.size());
+        for (int shift = 0; shift < key_bits; shift += 8)
+        {
+            size_t counts[257] = {};
+            for (uint32_t item : items)
+                counts[((keys[item] >> shift) & 0xFF) + 1]++;
+            for (int digit = 0; digit < 256; digit++)
+                counts[digit + 1] += counts[digit];
+            for (uint32_t item : items)
+                scratch[counts[(keys[item] >> shift) & 0xFF]++] = item;
+            items.swap(scratch);
+        }
+    }
+
+    // Number of bits needed to hold values up to max_key.
+    inline int key_bits(uint32_t max_key)
+    {
+        int bits = 0;
+        while (bits < 32 && (max_key >> bits) != 0)
+            bits++;
+        return bits;
+    }
+}
+
+#endif
@@ -0,0 +1,454 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "linear_bvh.h"
+#include "simd.h"
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Node of a W-wide BVH (W = 4 or 8). Child bounds are stored as structure-of-arrays float lanes,
+// so one SIMD slab test covers every child of the node at once.
+template <int W>
+struct alignas(32) wide_bvh_node
+{
+    float bounds_min[3][W];
+    float bounds_max[3][W];
+    int32_t child[W];  // Interior child: node index. Leaf child: first primitive slot. Empty: -1
+    uint32_t count[W]; // Primitive count of a leaf child, 0 for interior and empty children
+};
+
+// Ray data in the precision the lane tests work in.
+struct wide_ray
+{
+    float origin[3];
+    float inv_dir[3];
+};
+
+namespace wide_bvh_kernels
+{
+    // Far slab distances are scaled up by this factor so that float rounding in the lane tests
+    // can only add false positives, never drop a box the ray really crosses.
+    constexpr float far_scale = 1.0000004f;
+
+    template <int W>
+    unsigned slab_test_scalar(const wide_bvh_node<W> &node, const wide_ray &r, float tmin, float tmax,
+                              float *tnear)
+    {
+        unsigned mask = 0;
+        for (int lane = 0; lane < W; lane++)
+        {
+            float lo = tmin, hi = tmax;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                float t0 = (node.bounds_min[axis][lane] - r.origin[axis]) * r.inv_dir[axis];
+                float t1 = (node.bounds_max[axis][lane] - r.origin[axis]) * r.inv_dir[axis];
+                lo = std::max(lo, std::min(t0, t1));
+                hi = std::min(hi, std::max(t0, t1) * far_scale);
+            }
+            tnear[lane] = lo;
+            if (lo <= hi)
+                mask |= 1u << lane;
+        }
+        return mask;
+    }
+
+#if RT_SIMD_X86
+    inline unsigned slab_test_sse(const float *const bmin[3], const float *const bmax[3], const wide_ray &r,
+                                  float tmin, float tmax, float *tnear)
+    {
+        // Tests four lanes with SSE, which every x86-64 host supports.
+        __m128 lo = _mm_set1_ps(tmin);
+        __m128 hi = _mm_set1_ps(tmax);
+        const __m128 scale = _mm_set1_ps(far_scale);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const __m128 o = _mm_set1_ps(r.origin[axis]);
+            const __m128 inv = _mm_set1_ps(r.inv_dir[axis]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bmin[axis]), o), inv);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bmax[axis]), o), inv);
+            lo = _mm_max_ps(lo, _mm_min_ps(t0, t1));
+            hi = _mm_min_ps(hi, _mm_mul_ps(_mm_max_ps(t0, t1), scale));
+        }
+        _mm_storeu_ps(tnear, lo);
+        return unsigned(_mm_movemask_ps(_mm_cmple_ps(lo, hi)));
+    }
+
+    RT_TARGET_AVX2 inline unsigned slab_test_avx2(const float *const bmin[3], const float *const bmax[3],
+                                                   const wide_ray &r, float tmin, float tmax, float *tnear)
+    {
+        // Tests eight lanes with AVX2; only called after cpu_has_avx2() succeeded.
+        __m256 lo = _mm256_set1_ps(tmin);
+        __m256 hi = _mm256_set1_ps(tmax);
+        const __m256 scale = _mm256_set1_ps(far_scale);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const __m256 o = _mm256_set1_ps(r.origin[axis]);
+            const __m256 inv = _mm256_set1_ps(r.inv_dir[axis]);
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bmin[axis]), o), inv);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bmax[axis]), o), inv);
+            lo = _mm256_max_ps(lo, _mm256_min_ps(t0, t1));
+            hi = _mm256_min_ps(hi, _mm256_mul_ps(_mm256_max_ps(t0, t1), scale));
+        }
+        _mm256_storeu_ps(tnear, lo);
+        return unsigned(_mm256_movemask_ps(_mm256_cmp_ps(lo, hi, _CMP_LE_OQ)));
+    }
+
+    template <int W>
+    unsigned slab_test_sse_lanes(const wide_bvh_node<W> &node, const wide_ray &r, float tmin, float tmax,
+                                 float *tnear)
+    {
+        unsigned mask = 0;
+        for (int k = 0; k < W; k += 4)
+        {
+            const float *bmin[3] = {&node.bounds_min[0][k], &node.bounds_min[1][k], &node.bounds_min[2][k]};
+            const float *bmax[3] = {&node.bounds_max[0][k], &node.bounds_max[1][k], &node.bounds_max[2][k]};
+            mask |= slab_test_sse(bmin, bmax, r, tmin, tmax, tnear + k) << k;
+        }
+        return mask;
+    }
+
+    inline unsigned slab_test_avx2_lanes(const wide_bvh_node<8> &node, const wide_ray &r, float tmin, float tmax,
+                                         float *tnear)
+    {
+        const float *bmin[3] = {node.bounds_min[0], node.bounds_min[1], node.bounds_min[2]};
+        const float *bmax[3] = {node.bounds_max[0], node.bounds_max[1], node.bounds_max[2]};
+        return slab_test_avx2(bmin, bmax, r, tmin, tmax, tnear);
+    }
+#endif
+}
+
+template <int W>
+class wide_bvh
+{
+    static_assert(W == 4 || W == 8, "wide_bvh supports 4 and 8 wide nodes");
+
+public:
+    std::vector<wide_bvh_node<W>> nodes;
+
+    // Collapses a binary BVH into W-wide nodes. Leaves keep the binary tree's primitive slots.
+    void build(const linear_bvh &binary)
+    {
+        nodes.clear();
+        lane_test = select_lane_test();
+        if (binary.empty())
+            return;
+
+        const auto &source = binary.nodes;
+        if (source[0].prim_count > 0)
+        {
+            // A single leaf: wrap it in a root node with one occupied lane.
+            nodes.push_back(empty_node());
+            set_lane(nodes[0], 0, source[0], int32_t(source[0].offset), source[0].prim_count);
+            return;
+        }
+
+        nodes.reserve(source.size() / 2 + 1);
+        collapse(source, 0);
+    }
+
+    bool empty() const { return nodes.empty(); }
+
+    // Calls visit(first, count) once for every leaf.
+    template <typename Fn>
+    void for_each_leaf(Fn &&visit) const
+    {
+        for (const wide_bvh_node<W> &node : nodes)
+            for (int lane = 0; lane < W; lane++)
+                if (node.count[lane] > 0)
+                    visit(uint32_t(node.child[lane]), node.count[lane]);
+    }
+
+    // Same contract as linear_bvh::traverse.
+    template <typename LeafFn>
+    bool traverse(const ray &r, interval ray_t, LeafFn &&intersect_leaf, int32_t root = 0) const
+    {
+        if (nodes.empty())
+            return false;
+
+        wide_ray wr;
+        const double dir[3] = {r.direction.x, r.direction.y, r.direction.z};
+        const double orig[3] = {r.origin.x, r.origin.y, r.origin.z};
+        for (int axis = 0; axis < 3; axis++)
+        {
+            wr.origin[axis] = float(orig[axis]);
+            wr.inv_dir[axis] = float(1.0 / dir[axis]);
+        }
+
+        struct entry
+        {
+            int32_t index;
+            uint32_t count;
+            float tnear;
+        };
+
+        entry stack[W * max_depth];
+        int stack_size = 0;
+        int32_t current = root;
+        bool hit_anything = false;
+        const float tmin = float(ray_t.min);
+
+        while (true)
+        {
+            if (current >= 0)
+            {
+                const wide_bvh_node<W> &node = nodes[current];
+                alignas(32) float tnear[W];
+                unsigned mask = lane_test(node, wr, tmin, far_bound(ray_t.max), tnear);
+
+                // Push the children that were hit, ordered so the nearest one is popped first.
+                int base = stack_size;
+                for (int lane = 0; lane < W; lane++)
+                {
+                    if (!(mask & (1u << lane)) || node.child[lane] < 0)
+                        continue;
+
+                    entry e = {node.child[lane], node.count[lane], tnear[lane]};
+                    int slot = stack_size++;
+                    while (slot > base && stack[slot - 1].tnear < e.tnear)
+                    {
+                        stack[slot] = stack[slot - 1];
+                        slot--;
+                    }
+                    stack[slot] = e;
+                }
+                current = -1;
+            }
+
+            if (stack_size == 0)
+                break;
+
+            entry e = stack[--stack_size];
+            if (e.tnear > ray_t.max)
+                continue; // A closer hit was found after this child was pushed.
+
+            if (e.count > 0)
+            {
+                if (intersect_leaf(uint32_t(e.index), e.count, ray_t))
+                {
+                    hit_anything = true;
+                    if (ray_t.max < ray_t.min)
+                        break;
+                }
+            }
+            else
+            {
+                current = e.index;
+            }
+        }
+
+        return hit_anything;
+    }
+
+    // Same contract as linear_bvh::traverse_packet. Each child box of a node is tested against all
+    // the rays that entered the node, and the child is visited with the mask of rays that hit it.
+    template <typename LaneLeafFn>
+    unsigned traverse_packet(ray_packet &packet, unsigned active, LaneLeafFn &&intersect_leaf) const
+    {
+        if (nodes.empty() || !active)
+            return 0;
+
+        struct entry
+        {
+            int32_t index;
+            uint32_t count;
+            unsigned mask; // Lanes that hit this child's box
+            float tnear;   // Entry distance of the first of them
+        };
+
+        packet_rays rays(packet, active);
+        entry stack[W * max_depth];
+        int stack_size = 0;
+        stack[stack_size++] = {0, 0, active, 0};
+        unsigned hits = 0, finished = 0;
+
+        while (stack_size > 0 && finished != active)
+        {
+            const entry e = stack[--stack_size];
+            const unsigned mask = e.mask & ~finished;
+            if (!mask)
+                continue;
+            if (e.count > 0 || (mask & (mask - 1)) == 0)
+            {
+                // A leaf, or a subtree only one ray entered: test the rays one by one.
+                for (unsigned rest = mask; rest; rest &= rest - 1)
+                {
+                    const int lane = lowest_bit(rest);
+                    auto lane_leaf = [&](uint32_t first, uint32_t count, interval &t)
+                    { return intersect_leaf(lane, first, count, t); };
+                    interval &t = packet.ranges[lane];
+                    bool found = e.count > 0 ? lane_leaf(uint32_t(e.index), e.count, t)
+                                             : traverse_lane(packet.rays[lane], t, lane_leaf, e.index);
+                    if (found)
+                    {
+                        hits |= 1u << lane;
+                        rays.set_tmax(lane, t.max);
+                        if (t.max < t.min)
+                            finished |= 1u << lane;
+                    }
+                }
+                continue;
+            }
+
+            // Push the children some ray hits, ordered so the nearest for its first ray pops first.
+            const wide_bvh_node<W> &node = nodes[e.index];
+            const float *const bmin[3] = {node.bounds_min[0], node.bounds_min[1], node.bounds_min[2]};
+            const float *const bmax[3] = {node.bounds_max[0], node.bounds_max[1], node.bounds_max[2]};
+            unsigned child_masks[W];
+            float tnear[W];
+            packet_kernels::box_test(bmin, bmax, W, rays, mask, child_masks, tnear);
+
+            const int base = stack_size;
+            for (int lane = 0; lane < W; lane++)
+            {
+                if (!child_masks[lane] || node.child[lane] < 0)
+                    continue;
+
+                entry c = {node.child[lane], node.count[lane], child_masks[lane], tnear[lane]};
+                int slot = stack_size++;
+                while (slot > base && stack[slot - 1].tnear < c.tnear)
+                {
+                    stack[slot] = stack[slot - 1];
+                    slot--;
+                }
+                stack[slot] = c;
+            }
+        }
+
+        return hits;
+    }
+
+    // traverse() from root, shrinking ray_t to the closest hit found.
+    template <typename LeafFn>
+    bool traverse_lane(const ray &r, interval &ray_t, LeafFn &&intersect_leaf, int32_t root) const
+    {
+        interval closest = ray_t;
+        auto leaf = [&](uint32_t first, uint32_t count, interval &t)
+        {
+            bool found = intersect_leaf(first, count, t);
+            if (found)
+                closest.max = t.max;
+            return found;
+        };
+        bool found = traverse(r, ray_t, leaf, root);
+        ray_t = closest;
+        return found;
+    }
+
+private:
+    using lane_test_fn = unsigned (*)(const wide_bvh_node<W> &, const wide_ray &, float, float, float *);
+
+    static constexpr int max_depth = 64;
+
+    lane_test_fn lane_test = select_lane_test();
+
+    static lane_test_fn select_lane_test()
+    {
+        // Runtime CPU dispatch: AVX2 for 8-wide nodes where available, SSE otherwise, and plain
+        // scalar code on non-x86 targets.
+#if RT_SIMD_X86
+        if constexpr (W == 8)
+        {
+            if (cpu_has_avx2())
+                return wide_bvh_kernels::slab_test_avx2_lanes;
+        }
+        return wide_bvh_kernels::slab_test_sse_lanes<W>;
+#else
+        return wide_bvh_kernels::slab_test_scalar<W>;
+#endif
+    }
+
+    static float far_bound(double t)
+    {
+        float f = float(t);
+        return double(f) < t ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+
+    static wide_bvh_node<W> empty_node()
+    {
+        wide_bvh_node<W> node;
+        for (int lane = 0; lane < W; lane++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                node.bounds_min[axis][lane] = std::numeric_limits<float>::infinity();
+                node.bounds_max[axis][lane] = -std::numeric_limits<float>::infinity();
+            }
+            node.child[lane] = -1;
+            node.count[lane] = 0;
+        }
+        return node;
+    }
+
+    static void set_lane(wide_bvh_node<W> &node, int lane, const linear_bvh_node &source, int32_t child,
+                         uint32_t count)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            node.bounds_min[axis][lane] = source.bounds_min[axis];
+            node.bounds_max[axis][lane] = source.bounds_max[axis];
+        }
+        node.child[lane] = child;
+        node.count[lane] = count;
+    }
+
+    static double area(const linear_bvh_node &node)
+    {
+        double dx = double(node.bounds_max[0]) - node.bounds_min[0];
+        double dy = double(node.bounds_max[1]) - node.bounds_min[1];
+        double dz = double(node.bounds_max[2]) - node.bounds_min[2];
+        return 2.0 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    int32_t collapse(const std::vector<linear_bvh_node> &source, uint32_t index)
+    {
+        // Gather up to W descendants of an interior binary node by repeatedly opening the interior
+        // child with the largest surface area, then emit them as the lanes of one wide node.
+        const int32_t node_index = int32_t(nodes.size());
+        nodes.push_back(empty_node());
+
+        uint32_t children[W];
+        int child_count = 2;
+        children[0] = index + 1;
+        children[1] = source[index].offset;
+
+        while (child_count < W)
+        {
+            int best = -1;
+            double best_area = -1;
+            for (int i = 0; i < child_count; i++)
+            {
+                const linear_bvh_node &c = source[children[i]];
+                if (c.prim_count == 0 && area(c) > best_area)
+                {
+                    best = i;
+                    best_area = area(c);
+                }
+            }
+            if (best < 0)
+                break;
+
+            uint32_t opened = children[best];
+            children[best] = opened + 1;
+            children[child_count++] = source[opened].offset;
+        }
+
+        for (int lane = 0; lane < child_count; lane++)
+        {
+            const linear_bvh_node &c = source[children[lane]];
+            if (c.prim_count > 0)
+            {
+                set_lane(nodes[node_index], lane, c, int32_t(c.offset), c.prim_count);
+            }
+            else
+            {
+                int32_t child = collapse(source, children[lane]); // may reallocate nodes
+                set_lane(nodes[node_index], lane, c, child, 0);
+            }
+        }
+
+        return node_index;
+    }
+};
+
+#endif